@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h> //for power operator
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #include "mpc/mpc.h" //written by books author, buildyourownlisp.com
 
@@ -42,15 +45,20 @@ void add_history(char* unused) {}
   if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, LTYPE(args->cell[index]) == expect, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(LTYPE(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
     "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
     func, args->count, num)
 
+#define LASSERT_SEQ(func, args, index) \
+  LASSERT(args, LTYPE(args->cell[index]) == LVAL_QEXPR || LTYPE(args->cell[index]) == LVAL_SEQ, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.", \
+    func, index, ltype_name(LTYPE(args->cell[index])), ltype_name(LVAL_QEXPR), ltype_name(LVAL_SEQ))
+
 #define LASSERT_NOT_EMPTY(func, args, index) \
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
@@ -68,13 +76,17 @@ mpc_parser_t* Lisp;
 
 struct lval;
 struct lenv;
+struct lsym;
+struct lnode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lsym lsym;
+typedef struct lnode lnode;
 
 // Lisp Value
 
 enum {  LVAL_ERR, LVAL_NUM,   LVAL_SYM, LVAL_STR,
-	LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+	LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_ENV, LVAL_CODE, LVAL_SEQ };
 
 char* ltype_name(int t) {
   switch(t) {
@@ -85,63 +97,462 @@ char* ltype_name(int t) {
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_ENV: return "Environment";
+    case LVAL_CODE: return "Code";
+    case LVAL_SEQ: return "Sequence";
     default: return "Unknown";
   }
 }
 
+// kinds of sequence
+enum { LSEQ_RANGE, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE, LSEQ_ITERATE };
+
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
-struct lval {
-	int type;
+/* only the fields for a value's type are ever live, so they share storage.
+ * strings shorter than LVAL_TEXT bytes are kept inside the value itself */
+#define LVAL_TEXT 24
 
-	/* Basic */
-	long num;
-	char* err;
-	char* sym;
-	char* str;
-	
-	/* Function */
-	lbuiltin builtin;
-	lenv* env;
-	lval* formals;
-	lval* body;
-	
-	/* Expression */
-	int count;
-	lval** cell;
+struct lval {
+	unsigned char type;
+	unsigned char gc_gen; // generation the value lives in
+	unsigned char view; // expression whose cells belong to another, see lval_slice
+	unsigned char rest; // lambda whose formals end in & and a symbol for the rest
+	int refs; // number of owners sharing this value, it is only mutated when refs == 1
+	int gc_refs; // scratch count used while collecting
+	int arity; // formals of a lambda before any &
+
+	/* Heap */
+	lval* gc_prev;
+	lval* gc_next;
+
+	union {
+		/* Number */
+		long num;
+
+		/* Symbol, with the frame depth and slot it was last found at, or depth -1 */
+		struct {
+			lsym* sym;
+			int depth;
+			int slot;
+		};
+
+		/* Error and String */
+		struct {
+			union { char* err; char* str; };
+			char text[LVAL_TEXT];
+		};
+
+		/* Function, lambdas share the environment they were created in. a partial
+		 * application has no environment, it holds the lambda it applies and the
+		 * arguments it was given so far */
+		struct {
+			lbuiltin builtin;
+			lenv* env;
+			union { lval* formals; lval* fun; };
+			union { lval* body; lval* bound; };
+		};
+
+		/* Expression, with the code it compiled to once the VM has evaluated it.
+		 * cell points head slots into a buffer with room for size cells, so
+		 * popping the front only moves the pointer along. a view has no buffer,
+		 * its cells are a run of the cells of the owner it holds a reference to */
+		struct {
+			int count;
+			int size;
+			lval** cell;
+			lval* code;
+			union { int head; lval* owner; };
+		};
+
+		/* Code, the bytecode or analyzed tree of an expression and the constants it refers to */
+		struct {
+			int* ops;
+			lval** consts;
+			int nops;     // ops, or nodes in an analyzed tree
+			int nconsts;
+			lnode* nodes; // analyzed tree, with the root first, or NULL for bytecode
+		};
+
+		/* Sequence, a recipe for elements that are only made as they are
+		 * pulled out of it, see liter_next. sequences are never changed */
+		struct {
+			int kind;
+			lval* fn;     // function of map, filter and iterate
+			union {
+				lval* src;  // sequence or list the elements come from, or the first value of iterate
+				long from;  // start of a range
+			};
+			long limit;   // end of a range, how many elements take lets through, or 1 for a filter fused in
+		};
+
+		/* Environment, only ever held by functions and other environments */
+		lenv* scope;
+	};
 };
 
+/* Immediate numbers
+ *
+ * lvals are always at least two byte aligned, so a pointer with its lowest
+ * bit set can never point at one. numbers that fit in the remaining bits are
+ * stored shifted up inside the pointer itself with that bit set, and never
+ * touch the heap. only numbers too big for that are boxed in an lval, so
+ * always read the type and number of a value through LTYPE and LNUM
+ */
+#define LIMM_MIN (INTPTR_MIN >> 1)
+#define LIMM_MAX (INTPTR_MAX >> 1)
+
+#define LVAL_IMM(v) (((uintptr_t)(v)) & 1)
+#define LTYPE(v) (LVAL_IMM(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LVAL_IMM(v) ? (long)((intptr_t)(v) >> 1) : (v)->num)
+
+/* bindings are kept in insertion order, so a binding's slot never changes.
+ * small frames (most lambda calls) keep them inline and are searched
+ * linearly, frames with more than LENV_LINEAR bindings get an open
+ * addressing index from symbol to slot */
+#define LENV_INLINE 4
+#define LENV_LINEAR 8
+
 struct lenv {
 	lenv* par;
+	lval* self;   // the value boxing this environment once a function captured it, see lenv_box
+	int let;      // a let's frame, on the let stack rather than from the pool
 	int count;
-	char** syms;
+	int size;     // slots allocated in syms and vals
+	lsym** syms;
 	lval** vals;
+	int* index;   // slot+1 for each symbol hashed here, 0 when empty, or NULL while small
+	int index_size;
+	lsym* inline_syms[LENV_INLINE];
+	lval* inline_vals[LENV_INLINE];
+};
+
+/* Symbols
+ *
+ * every distinct symbol name is stored once, in the symbol table. symbol
+ * lvals and environments hold pointers to the interned lsym so symbols are
+ * compared by pointer and never copied. symbols live as long as the process
+ */
+struct lsym {
+	unsigned long hash;
+	int local;  // ever bound in a function's environment rather than the global one
+	lenv* genv; // the global environment and slot holding the symbol, while it has never been local
+	int gslot;
+	char name[];
+};
+
+struct lsymtab {
+	int size;    // slots, always a power of two
+	int count;
+	lsym** slots;
+};
+
+struct lsymtab symtab;
+
+// symbols the interpreter itself looks for
+lsym* lsym_rest; // &
+lsym* lsym_if;
+lsym* lsym_def;
+lsym* lsym_put;    // =
+lsym* lsym_lambda; // \ (lambda)
+lsym* lsym_let;
+
+unsigned long lsym_hash(char* s) {
+	// FNV-1a
+	unsigned long h = 2166136261u;
+	for (; *s; s++) { h = (h ^ (unsigned char)*s) * 16777619u; }
+	return h;
+}
+
+lsym* lsym_intern(char* name) {
+	unsigned long h = lsym_hash(name);
+
+	// linear probe for the name or the empty slot where it belongs
+	int i = h & (symtab.size - 1);
+	while (symtab.slots[i]) {
+		if (symtab.slots[i]->hash == h && strcmp(symtab.slots[i]->name, name) == 0) {
+			return symtab.slots[i];
+		}
+		i = (i + 1) & (symtab.size - 1);
+	}
+
+	lsym* s = malloc(sizeof(lsym) + strlen(name) + 1);
+	s->hash = h;
+	s->local = 0;
+	s->genv = NULL;
+	s->gslot = 0;
+	strcpy(s->name, name);
+	symtab.slots[i] = s;
+
+	// keep the table at most half full, rehashing into one twice the size
+	if (++symtab.count * 2 > symtab.size) {
+		struct lsymtab old = symtab;
+		symtab.size *= 2;
+		symtab.slots = calloc(symtab.size, sizeof(lsym*));
+		for (int j = 0; j < old.size; j++) {
+			if (!old.slots[j]) { continue; }
+			int k = old.slots[j]->hash & (symtab.size - 1);
+			while (symtab.slots[k]) { k = (k + 1) & (symtab.size - 1); }
+			symtab.slots[k] = old.slots[j];
+		}
+		free(old.slots);
+	}
+	return s;
+}
+
+void lsym_init(void) {
+	symtab.size = 256;
+	symtab.count = 0;
+	symtab.slots = calloc(symtab.size, sizeof(lsym*));
+	lsym_rest = lsym_intern("&");
+	lsym_if = lsym_intern("if");
+	lsym_def = lsym_intern("def");
+	lsym_put = lsym_intern("=");
+	lsym_lambda = lsym_intern("\\");
+	lsym_let = lsym_intern("let");
+}
+
+/* Heap
+ *
+ * every lval is linked into the heap so the collector can find it. reference
+ * counts free most values the moment their last owner lets go of them, the
+ * mark-sweep collector reclaims what counting alone cannot: groups of values
+ * that only keep each other alive. roots are found by subtracting the
+ * references values hold to each other from their counts, whatever is left
+ * over is held from outside the heap (the global environment, or the evaluator
+ * on the C stack) and everything reachable from those is kept
+ *
+ * the heap is generational. new values start in the young generation (the
+ * nursery), most of them are temporaries that die within one call. a minor
+ * collection only scans the young generation, references from old values
+ * count as roots, and promotes everything that survives to the old
+ * generation. the whole heap is only scanned once the old generation has
+ * grown enough. values never move, the evaluator holds plain pointers to
+ * them on the C stack, so the nursery is carved out of pool slabs with a
+ * bump pointer and freed values are threaded onto a free list for reuse
+ */
+
+/* Pools
+ *
+ * fixed size allocations (lvals, lenvs and small cell arrays) come from
+ * pools, one per size. each pool carves items out of large slabs with a
+ * bump pointer and keeps the items released back to it on a free list
+ * threaded through the items themselves. slabs are never given back, so
+ * long running processes can check occupancy with (pool-stats {}) to see
+ * how much of the memory held is actually in use
+ */
+struct lslab {
+	struct lslab* next;
+};
+
+struct lpool {
+	char* name;
+	size_t size;         // bytes per item
+	int per_slab;        // items carved out of each slab
+	void* free;          // items released back to the pool, reused first
+	char* bump;          // next never used item in the newest slab
+	char* limit;         // end of the newest slab
+	struct lslab* slabs;
+	long slab_count;
+	long used;           // items currently handed out
+	long peak;           // most items ever handed out at once
+};
+
+// let address sanitizer catch use of items sitting on a free list
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define LPOOL_POISON(x, n)   ASAN_POISON_MEMORY_REGION((x), (n))
+#define LPOOL_UNPOISON(x, n) ASAN_UNPOISON_MEMORY_REGION((x), (n))
+#else
+#define LPOOL_POISON(x, n)
+#define LPOOL_UNPOISON(x, n)
+#endif
+
+void* lpool_alloc(struct lpool* p) {
+	void* x;
+	if (p->free) {
+		// reuse a released item
+		x = p->free;
+		LPOOL_UNPOISON(x, p->size);
+		p->free = *(void**)x;
+	} else {
+		// otherwise bump through the newest slab, starting a new one when it runs out
+		if (p->bump == p->limit) {
+			struct lslab* s = malloc(sizeof(struct lslab) + p->size * p->per_slab);
+			s->next = p->slabs;
+			p->slabs = s;
+			p->slab_count++;
+			p->bump = (char*)(s + 1);
+			p->limit = p->bump + p->size * p->per_slab;
+		}
+		x = p->bump;
+		p->bump += p->size;
+	}
+	if (++p->used > p->peak) { p->peak = p->used; }
+	return x;
+}
+
+// bytes held by the pool, or only those in items currently handed out if live
+long lpool_bytes(struct lpool* p, int live) {
+	if (live) { return p->used * p->size; }
+	return p->slab_count * (sizeof(struct lslab) + p->size * p->per_slab);
+}
+
+void lpool_free(struct lpool* p, void* x) {
+	*(void**)x = p->free;
+	p->free = x;
+	p->used--;
+	LPOOL_POISON(x, p->size);
+}
+
+/* sizes are multiples of the pointer size so every item can hold the free list link */
+#define LPOOL(name, size, per_slab) \
+  { name, ((size) + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*), per_slab, NULL, NULL, NULL, NULL, 0, 0, 0 }
+
+struct lpool lval_pool = LPOOL("lval", sizeof(lval), 1024);
+struct lpool lenv_pool = LPOOL("lenv", sizeof(lenv), 256);
+
+/* cell arrays of up to LCELLS_MAX pointers come from pools with a power of two
+ * capacity, bigger ones come from malloc with exactly the size asked for */
+#define LCELLS_CLASSES 5
+#define LCELLS_MAX 16
+
+struct lpool lcells_pool[LCELLS_CLASSES] = {
+	LPOOL("cells1",  1 * sizeof(lval*), 1024),
+	LPOOL("cells2",  2 * sizeof(lval*), 1024),
+	LPOOL("cells4",  4 * sizeof(lval*), 512),
+	LPOOL("cells8",  8 * sizeof(lval*), 256),
+	LPOOL("cells16", 16 * sizeof(lval*), 128),
 };
 
+// size class of an array with room for size cells, or -1 if it comes from malloc
+int lcells_class(int size) {
+	if (size == 0 || size > LCELLS_MAX) { return -1; }
+	int c = 0;
+	while ((1 << c) < size) { c++; }
+	return c;
+}
+
+// room an array asked to hold n cells really has, pooled arrays get their whole class
+int lcells_size(int n) {
+	int c = lcells_class(n);
+	return c == -1 ? n : 1 << c;
+}
+
+// cells allocated for lists so far, shown by gc-stats
+long lcells_allocated = 0;
+
+// allocate an array with room for size cells, size should come from lcells_size
+lval** lcells_alloc(int size) {
+	lcells_allocated += size;
+	int c = lcells_class(size);
+	if (c != -1) { return lpool_alloc(&lcells_pool[c]); }
+	return size ? malloc(sizeof(lval*) * size) : NULL;
+}
+
+void lcells_free(lval** cell, int size) {
+	int c = lcells_class(size);
+	if (c != -1) { lpool_free(&lcells_pool[c], cell); }
+	else { free(cell); }
+}
+
+enum { LGEN_YOUNG, LGEN_OLD };
+
+struct lheap {
+	lval young;          // sentinels of the circular list of values in each generation
+	lval old;
+	long young_count;
+	long old_count;
+
+	long allocs;         // allocations since the last minor collection
+	long nursery;        // allocations that trigger a minor collection
+	long old_limit;      // old generation size that triggers a major collection
+	int growth;          // how far the old generation may grow past what survived the last major collection, in percent
+	int pending;         // a collection is due at the next safe point
+
+	long minor;
+	long major;
+	long freed;          // values freed by the collector, over all collections
+};
+
+struct lheap heap;
+
+void lheap_link(lval* list, lval* v) {
+	v->gc_prev = list;
+	v->gc_next = list->gc_next;
+	list->gc_next->gc_prev = v;
+	list->gc_next = v;
+}
+
+void lheap_unlink(lval* v) {
+	v->gc_prev->gc_next = v->gc_next;
+	v->gc_next->gc_prev = v->gc_prev;
+}
+
+void lheap_init(void) {
+	heap.young.gc_prev = heap.young.gc_next = &heap.young;
+	heap.old.gc_prev = heap.old.gc_next = &heap.old;
+	heap.nursery = 10000;
+	heap.old_limit = 10000;
+	heap.growth = 100;
+}
+
+lval* lval_alloc(int type) {
+	lval* v = lpool_alloc(&lval_pool);
+	v->type = type;
+	v->refs = 1;
+
+	// every new value starts out young
+	v->gc_gen = LGEN_YOUNG;
+	lheap_link(&heap.young, v);
+	heap.young_count++;
+
+	// collections only run at safe points in the evaluator, never mid construction
+	if (++heap.allocs >= heap.nursery) { heap.pending = 1; }
+	return v;
+}
+
+void lval_free(lval* v) {
+	lheap_unlink(v);
+	if (v->gc_gen == LGEN_YOUNG) { heap.young_count--; } else { heap.old_count--; }
+	lpool_free(&lval_pool, v);
+}
+
 // construct pointer to new Number, Error, Symbol, Fun, and empty S expr or Q expr lval 
 lval* lval_num(long x) {
-	lval* v = malloc(sizeof(lval));;
-	v->type = LVAL_NUM;
+	// small numbers live in the pointer
+	if (x >= LIMM_MIN && x <= LIMM_MAX) { return (lval*)(((uintptr_t)x << 1) | 1); }
+
+	lval* v = lval_alloc(LVAL_NUM);
 	v->num = x;
 	return v;
 }
 
+// copy s into v's text, inside v when it is short enough otherwise on the heap
+char* lval_text(lval* v, char* s) {
+	size_t n = strlen(s)+1; //the plus one is because strlen excludes the null terminating byte
+	char* t = n <= LVAL_TEXT ? v->text : malloc(n);
+	memcpy(t, s, n);
+	return t;
+}
+
+void lval_text_free(lval* v) {
+	if (v->str != v->text) { free(v->str); }
+}
+
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval* v = lval_alloc(LVAL_ERR);
   
   /* Create a va list and initialize it */
   va_list va;
   va_start(va, fmt);
   
-  /* Allocate 512 bytes of space */
-  v->err = malloc(512); // make sure error messages arent longer than 512
-  
   /* printf the error string with a maximum of 511 characters */
-  vsnprintf(v->err, 511, fmt, va);
+  char buf[512]; // make sure error messages arent longer than 512
+  vsnprintf(buf, 511, fmt, va);
   
-  /* Reallocate to number of bytes actually used */
-  v->err = realloc(v->err, strlen(v->err)+1);
+  /* Copy out the number of bytes actually used */
+  v->err = lval_text(v, buf);
   
   /* Cleanup our va list */
   va_end(va);
@@ -150,62 +561,63 @@ lval* lval_err(char* fmt, ...) {
 }
 
 lval* lval_sym(char* s) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(s)+1); //the plus one is because strlen excludes the null terminating byte
-	strcpy(v->sym, s);
+	lval* v = lval_alloc(LVAL_SYM);
+	v->sym = lsym_intern(s);
+	v->depth = -1;
+	v->slot = 0;
 	return v;
 }
 
 lval* lval_str(char* s) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_STR;
-	v->str = malloc(strlen(s)+1); 
-	strcpy(v->str, s);
+	lval* v = lval_alloc(LVAL_STR);
+	v->str = lval_text(v, s);
 	return v;
 }
 
 lval* lval_fun(lbuiltin func) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
+	lval* v = lval_alloc(LVAL_FUN);
 	v->builtin = func;
 	return v;
 }
 
 lval* lval_sexpr(void) { 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SEXPR;
+	lval* v = lval_alloc(LVAL_SEXPR);
+	v->view = 0;
 	v->count = 0;
+	v->size = 0;
+	v->head = 0;
 	v->cell = NULL;
+	v->code = NULL;
 	return v;
 }
 
 lval* lval_qexpr(void) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_QEXPR;
+	lval* v = lval_alloc(LVAL_QEXPR);
+	v->view = 0;
 	v->count = 0;
+	v->size = 0;
+	v->head = 0;
 	v->cell = NULL;
+	v->code = NULL;
 	return v;
 }
 
 // create and delete lenv structs
-lenv* lenv_new(void) {
-	lenv* e = malloc(sizeof(lenv));
+lenv* lenv_init(lenv* e) {
 	e->par = NULL;
+	e->self = NULL;
+	e->let = 0;
 	e->count = 0;
-	e->syms = NULL;
-	e->vals = NULL;
+	e->size = LENV_INLINE;
+	e->syms = e->inline_syms;
+	e->vals = e->inline_vals;
+	e->index = NULL;
+	e->index_size = 0;
 	return e;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
-	v->builtin = NULL;
-	v->env = lenv_new();
-	v->formals = formals;
-	v->body = body;
-	return v;
+lenv* lenv_new(void) {
+	return lenv_init(lpool_alloc(&lenv_pool));
 }
 
 // delete lval* and free the memory
@@ -213,42 +625,213 @@ void lval_del(lval* v);
 
 void lenv_del(lenv* e) {
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
     lval_del(e->vals[i]);
   }  
-  free(e->syms);
-  free(e->vals);
-  free(e);
+  if (e->syms != e->inline_syms) {
+    free(e->syms);
+    free(e->vals);
+  }
+  free(e->index);
+  if (!e->let) { lpool_free(&lenv_pool, e); }
 }
 
 lval* lval_read(mpc_ast_t* t);
 lval* lval_copy(lval* v);
+lenv* lenv_copy(lenv* e);
+
+// share v with another owner, every lval_ref needs a matching lval_del
+lval* lval_ref(lval* v) {
+	if (LVAL_IMM(v)) { return v; }
+	v->refs++;
+	return v;
+}
+
+// make sure the caller is the only owner of v before it gets mutated,
+// shared values are copied (one level deep) and the callers reference released
+lval* lval_own(lval* v) {
+	if (LVAL_IMM(v)) { return v; }
+	if (v->refs == 1) {
+		// the caller is about to change it, so forget any code it compiled to
+		if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->code) {
+			lval_del(v->code);
+			v->code = NULL;
+		}
+		return v;
+	}
+	lval* x = lval_copy(v);
+	lval_del(v);
+	return x;
+}
+
+// --dynamic: call frames sit in the caller's environment, as before lexical scoping
+int lenv_dynamic = 0;
+
+/* Environments
+ *
+ * an environment starts out owned by whoever created it, the evaluator for a
+ * call frame or main for the global environment. when a function captures it,
+ * it is boxed in an LVAL_ENV value so it can be shared and collected like any
+ * other value: the creator's ownership becomes the box's first reference and
+ * every capturing function holds another. a boxed environment also holds a
+ * reference to its parent, so frames that are never captured cost nothing
+ */
+lval* lenv_box(lenv* e) {
+	if (!e->self) {
+		if (e->let) {
+			// a let's frame is given back when the let ends, so a copy of it is captured instead
+			e->self = lenv_box(lenv_copy(e));
+			return e->self;
+		}
+		if (e->par) {
+			lval* p = lval_ref(lenv_box(e->par));
+			e->par = p->scope;
+		}
+		e->self = lval_alloc(LVAL_ENV);
+		e->self->scope = e;
+	}
+	return e->self;
+}
+
+// give up the creator's ownership of e
+void lenv_release(lenv* e) {
+	if (e->self) { lval_del(e->self); } else { lenv_del(e); }
+}
+
+/* Let frames
+ *
+ * lets end in the reverse order they start, so their frames are taken from
+ * the top of a stack rather than the lenv pool. the stack grows a chunk at a
+ * time so frames never move while in use. functions created inside a let
+ * capture a copy of its frame (see lenv_box), which then no longer sees
+ * variables the let's body defines with = afterwards
+ */
+#define LLETS_CHUNK 64
+
+struct llets {
+	lenv** chunks;
+	int nchunks;
+	int count;
+};
+
+struct llets llets;
+
+lenv* llet_push(lenv* par) {
+	if (llets.count == llets.nchunks * LLETS_CHUNK) {
+		llets.chunks = realloc(llets.chunks, sizeof(lenv*) * (llets.nchunks + 1));
+		llets.chunks[llets.nchunks++] = malloc(sizeof(lenv) * LLETS_CHUNK);
+	}
+	lenv* e = lenv_init(&llets.chunks[llets.count / LLETS_CHUNK][llets.count % LLETS_CHUNK]);
+	llets.count++;
+	e->par = par;
+	e->let = 1;
+	return e;
+}
+
+// end lets until count are left
+void llet_unwind(int count) {
+	while (llets.count > count) {
+		llets.count--;
+		lenv* e = &llets.chunks[llets.count / LLETS_CHUNK][llets.count % LLETS_CHUNK];
+		if (e->self) { lval_del(e->self); }
+		lenv_del(e);
+	}
+}
+
+// lambdas capture the environment they are created in. formals must hold
+// symbols, with any & followed by exactly one more
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+	lval* v = lval_alloc(LVAL_FUN);
+	v->builtin = NULL;
+	lval* box = lval_ref(lenv_box(e));
+	v->env = box->scope;
+	v->formals = formals;
+	v->body = body;
+	v->rest = formals->count >= 2 && formals->cell[formals->count - 2]->sym == lsym_rest;
+	v->arity = v->rest ? formals->count - 2 : formals->count;
+	return v;
+}
+
+// the lambda f with the arguments in bound applied to it, waiting for the rest
+lval* lval_partial(lval* f, lval* bound) {
+	lval* v = lval_alloc(LVAL_FUN);
+	v->builtin = NULL;
+	v->env = NULL;
+	v->fun = lval_ref(f);
+	v->bound = bound;
+	v->rest = 0;
+	v->arity = f->arity - bound->count;
+	return v;
+}
+
+// the lambda f calls, f itself unless it is a partial application
+lval* lval_target(lval* f) {
+	return f->env ? f : f->fun;
+}
+
 //print an lval
 void lval_print(lval* v);
 //print an lval and append a newline
 void lval_println(lval* v) { lval_print(v); putchar('\n'); }
 
 lval* lval_add(lval* v, lval* x);
+void lval_reserve(lval* v, int n); // makes room for v to hold n cells without moving them again
+lval* lval_slice(lval* v, int from, int n); // n cells of v from 'from' on, shared rather than copied unless they are a small part of a big list
+lval* lval_seq(int kind, lval* fn, lval* src, long limit);
+lval* lval_join(lval* x, lval* y); // appends the cells of y to x, deleting y
 
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_eval_expr(lenv* e, lval* v);
+lval* lval_eval_qexpr(lenv* e, lval* x);
 
 lval* lval_pop(lval* v, int i); // takes an index i and removes it from v, then returns it, leaving the rest of v intact
 lval* lval_take(lval* v, int i); // takes an index i from v and returns it, deleting all of v in the process
 
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** frame_out);
 lval* lval_call(lenv* e, lval* f, lval* a);
 
+// how S-Expressions are evaluated, --tree walks them directly instead of compiling them for the VM
+// and --analyze executes a tree of nodes analyzed from them once
+enum { LEVAL_TREE, LEVAL_VM, LEVAL_ANALYZE };
+int leval_mode = LEVAL_VM;
+
+// --fuse: a map or filter read by another builtin is made lazily, see Fusion
+int lfuse = 0;
+
+// frames the VM may nest before recursion evaluates to an error, --max-depth
+int lvm_max_depth = 1000000;
+
+lval* lval_code(lval* v);
+lval* lvm_run(lenv* e, lval* code);
+lval* lvm_eval(lenv* e, lval* v);
+lval* lval_analysis(lval* v);
+lval* lnode_run(lval* code, lenv* e, lval* fun);
+lval* lnode_eval(lenv* e, lval* v);
+
+long lgc_collect(void);
+long lgc_collect_minor(void);
+long lgc_bytes(int live);
+
 lval* builtin(lenv* e, lval* a, char* func);
-lval* builtin_op(lenv* e, lval* a, char* op);
 lval* builtin_def(lenv* e, lval* a);
+lval* builtin_put(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
 lval* builtin_eval(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* lval_eval_arg(lval* a);
+lval* lval_if_branch(lval* a);
 lval* builtin_load(lenv* e, lval* a);
+lval* builtin_for_each(lenv* e, lval* a);
+
+lval* lval_binary(lbuiltin b, lval* x, lval* y); // b on two small numbers without an argument list, or NULL
+int lfuse_pos(lbuiltin b);
+lbuiltin lfuse_lazy(lbuiltin b);
+lval* lfuse_call(lenv* e, lbuiltin b, lval* a);
 
-void lval_expr_print(lval* v, char open, char close);
 
 lval* lenv_get(lenv* e, lval* k);
-lenv* lenv_copy(lenv* e);
+void lval_resolve(lval* v, lval* formals, lenv* e);
 void lenv_def(lenv* e, lval* k, lval* v);
 void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_add_builtins(lenv* e);
@@ -258,7 +841,7 @@ int main(int argc, char** argv) {
 	Number  = mpc_new("number");
 	Symbol  = mpc_new("symbol");
 	String  = mpc_new("string"); 	
-	Comment = mpc_new("Comment"); 
+	Comment = mpc_new("comment"); 
 	Sexpr   = mpc_new("sexpr");
 	Qexpr   = mpc_new("qexpr");
 	Expr    = mpc_new("expr");
@@ -278,11 +861,43 @@ int main(int argc, char** argv) {
   		",
   		Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lisp);
 
+	lheap_init();
+	lsym_init();
+
+	// options come before any files
+	int first = 1;
+	for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+		if (strcmp(argv[first], "--dynamic") == 0) {
+			lenv_dynamic = 1;
+		} else if (strcmp(argv[first], "--tree") == 0) {
+			leval_mode = LEVAL_TREE;
+		} else if (strcmp(argv[first], "--vm") == 0) {
+			leval_mode = LEVAL_VM;
+		} else if (strcmp(argv[first], "--analyze") == 0) {
+			leval_mode = LEVAL_ANALYZE;
+		} else if (strcmp(argv[first], "--fuse") == 0) {
+			lfuse = 1;
+		} else if (strcmp(argv[first], "--max-depth") == 0) {
+			// anything but a positive number of frames would fail every call or remove the limit
+			char* end = NULL;
+			long n = first + 1 < argc ? strtol(argv[first + 1], &end, 10) : 0;
+			if (!end || end == argv[first + 1] || *end || n <= 0 || n > INT_MAX) {
+				fprintf(stderr, "--max-depth needs a positive whole number of frames\n");
+				return EXIT_FAILURE;
+			}
+			lvm_max_depth = n;
+			first++;
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[first]);
+			return EXIT_FAILURE;
+		}
+	}
+
 	lenv* e = lenv_new();
 	lenv_add_builtins(e);
 
 	// interactive prompt
-	if (argc == 1) {
+	if (first == argc) {
 		puts("Xen: A Lisp Interpreter for C");
 		puts("Version 0.0.0.1.4");
 		puts("Press Ctrl+C to Exit\n");
@@ -311,10 +926,10 @@ int main(int argc, char** argv) {
 		}
 	}
 	/* Supplied with list of files */
-	if (argc >= 2) {
+	if (first < argc) {
 
-  		/* loop over each supplied filename (starting from 1) */
-  		for (int i = 1; i < argc; i++) {
+  		/* loop over each supplied filename (starting after the options) */
+  		for (int i = first; i < argc; i++) {
 		    	/* Argument list with a single argument, the filename */
 		    	lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
 
@@ -322,12 +937,23 @@ int main(int argc, char** argv) {
 		    	lval* x = builtin_load(e, args);
 
 		    	/* If the result is an error be sure to print it */
-		    	if (x->type == LVAL_ERR) { lval_println(x); }
+		    	if (LTYPE(x) == LVAL_ERR) { lval_println(x); }
 		    	lval_del(x);
 		}
 	}
 	
-	lenv_del(e);
+	// functions defined globally hold the global environment, collect those cycles too
+	lenv_release(e);
+	lgc_collect();
+
+	// the pools keep their own memory, so report items leaked by the interpreter to sanitizer builds
+#if defined(__SANITIZE_ADDRESS__)
+	struct lpool* pools[2 + LCELLS_CLASSES] = { &lval_pool, &lenv_pool };
+	for (int i = 0; i < LCELLS_CLASSES; i++) { pools[2 + i] = &lcells_pool[i]; }
+	for (int i = 0; i < 2 + LCELLS_CLASSES; i++) {
+		if (pools[i]->used) { fprintf(stderr, "ERROR: %li %s items leaked\n", pools[i]->used, pools[i]->name); }
+	}
+#endif
 	
 	// undefine and delete our parsers
 	mpc_cleanup(8,
@@ -337,64 +963,358 @@ int main(int argc, char** argv) {
 	return EXIT_SUCCESS;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval *v) {
-	
-	// evaluate children
-	for (int i = 0; i < v->count; i++) {
-		v->cell[i] = lval_eval(e, v->cell[i]);
+/* Special forms
+ *
+ * if, def, =, \ and let are recognized by how an expression is written, so
+ * they dispatch without looking their name up and their arguments need no
+ * quoting. an S-Expression is a special form when:
+ *
+ *   (if c a b)              a and b are only evaluated when taken. a branch
+ *                           written as a Q-Expression has its children evaluated
+ *                           as before, so (if c {f x} {g y}) still works
+ *   (def x v) (= x v)       a bare name is defined rather than evaluated
+ *   (def {x y} a b)         as before, with the names given literally
+ *   (\ {x} body)            body may also be written as an S-Expression, (\ {x} (+ x 1))
+ *   (let ((x v) ...) body)  binds each x in turn in a frame of its own, then
+ *                           evaluates body there like an if branch
+ *
+ * written any other way they are ordinary calls, eg (def (head f) v) evaluates
+ * the names, and prelude functions named let taking one argument still work.
+ * since if is recognized by its name, branches that are variables holding a
+ * Q-Expression are no longer evaluated, write (if c (eval a) (eval b)) instead
+ */
+enum { LFORM_NONE, LFORM_IF, LFORM_DEF, LFORM_PUT, LFORM_LAMBDA, LFORM_LET };
+
+// the special form the S-Expression v is written as, or LFORM_NONE for a call
+int lval_form(lval* v) {
+	if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM) { return LFORM_NONE; }
+	lsym* s = v->cell[0]->sym;
+
+	// let is only a form, never a builtin, so llet_check reports a wrong number of arguments
+	if (s == lsym_let) { return LFORM_LET; }
+	if (v->count < 3) { return LFORM_NONE; }
+
+	int t = LTYPE(v->cell[1]);
+	if (s == lsym_if && v->count == 4) { return LFORM_IF; }
+	if (s == lsym_def || s == lsym_put) {
+		if ((t == LVAL_SYM && v->count == 3) || t == LVAL_QEXPR) {
+			return s == lsym_def ? LFORM_DEF : LFORM_PUT;
+		}
 	}
-	
-	// error checking
-	for (int i = 0; i < v->count; i++) {
-		if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+	if (s == lsym_lambda && t == LVAL_QEXPR && v->count == 3) { return LFORM_LAMBDA; }
+	return LFORM_NONE;
+}
+
+// the builtin the def, = and \ forms call
+lbuiltin lform_builtin(int form) {
+	switch (form) {
+		case LFORM_DEF: return builtin_def;
+		case LFORM_PUT: return builtin_put;
+		default: return builtin_lambda;
 	}
+}
 
-	// empty expr
-	if (v->count == 0) { return v; }
-	
-	// single expression
-	if (v->count == 1) { return lval_take(v, 0); }
+// argument i of the def, = or \ form v when it is passed as written, otherwise
+// NULL and the argument is evaluated
+lval* lform_literal(lval* v, int i) {
+	lval* x = v->cell[i];
+	if (LTYPE(x) == LVAL_QEXPR && i == 1) { return lval_ref(x); }
+	if (LTYPE(x) == LVAL_SYM && i == 1) { return lval_add(lval_qexpr(), lval_ref(x)); }
+	if (v->cell[0]->sym == lsym_lambda && LTYPE(x) == LVAL_QEXPR) { return lval_ref(x); }
+	return NULL;
+}
 
-	// ensure first element is function
-	lval* f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN) {
-		lval* err = lval_err(
-			"S-Expression starts with incorrect type. "
-			"Got %s, Expected %s.",
-			ltype_name(f->type), ltype_name(LVAL_FUN));
-	lval_del(f); lval_del(v);
-	return err;
+// an error unless the let form v binds ((name value) ...) for a single body
+lval* llet_check(lval* v) {
+	if (v->count != 3) {
+		return lval_err("Function 'let' passed incorrect number of arguments. Got %i, Expected %i.",
+			v->count - 1, 2);
+	}
+	lval* b = v->cell[1];
+	if (LTYPE(b) != LVAL_SEXPR) {
+		return lval_err("Function 'let' passed incorrect type for bindings. Got %s, Expected %s.",
+			ltype_name(LTYPE(b)), ltype_name(LVAL_SEXPR));
 	}
+	for (int i = 0; i < b->count; i++) {
+		lval* x = b->cell[i];
+		if (LTYPE(x) != LVAL_SEXPR || x->count != 2 || LTYPE(x->cell[0]) != LVAL_SYM) {
+			return lval_err("Function 'let' passed invalid binding %i. Expected (name value).", i);
+		}
+	}
+	return NULL;
+}
 
-	// call function to get result
-	lval* result = lval_call(e, f, v);
-	lval_del(f);
+// an error unless the condition of if is a number
+lval* lif_check(lval* c) {
+	if (LTYPE(c) == LVAL_ERR) { return lval_ref(c); }
+	if (LTYPE(c) != LVAL_NUM) {
+		return lval_err("Function 'if' passed incorrect type for argument 0. Got %s, Expected %s.",
+			ltype_name(LTYPE(c)), ltype_name(LVAL_NUM));
+	}
+	return NULL;
+}
+
+// evaluate the children of v as an S-Expression. v is only read, never changed
+// or consumed, so the body of a lambda is evaluated as it is on every call
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+
+	// calls to lambdas, eval and if in tail position continue this loop rather
+	// than recursing, evaluating in the frame of the lambda called last. the
+	// expression v is then the body of fun or the Q-Expression in held
+	lenv* frame = NULL;
+	lval* fun = NULL;
+	lval* held = NULL;
+	lval* result = NULL;
+	int lets = llets.count;
+
+	while (1) {
+		// empty expr
+		if (v->count == 0) { result = lval_sexpr(); break; }
+
+		// single expression
+		if (v->count == 1) { result = lval_eval_expr(e, v->cell[0]); break; }
+
+		// if and let continue with the branch taken or the body, in place of v
+		int form = lval_form(v);
+		if (form == LFORM_IF || form == LFORM_LET) {
+			lval* body = NULL;
+			if (form == LFORM_IF) {
+				lval* c = lval_eval_expr(e, v->cell[1]);
+				result = lif_check(c);
+				if (!result) { body = v->cell[LNUM(c) ? 2 : 3]; }
+				lval_del(c);
+			} else {
+				result = llet_check(v);
+				if (!result) { e = llet_push(e); }
+				for (int i = 0; !result && i < v->cell[1]->count; i++) {
+					lval* b = v->cell[1]->cell[i];
+					lval* x = lval_eval_expr(e, b->cell[1]);
+					if (LTYPE(x) == LVAL_ERR) { result = x; break; }
+					lenv_put(e, b->cell[0], x);
+					lval_del(x);
+				}
+				body = v->cell[2];
+			}
+			if (result) { break; }
+
+			// written as an expression it is evaluated as one, otherwise its children are
+			if (LTYPE(body) != LVAL_QEXPR && LTYPE(body) != LVAL_SEXPR) {
+				result = lval_eval_expr(e, body);
+				break;
+			}
+			v = body;
+			continue;
+		}
+
+		// def, = and \ pass the arguments written literally as they are
+		if (form != LFORM_NONE) {
+			lval* a = lval_sexpr();
+			for (int i = 1; i < v->count; i++) {
+				lval* x = lform_literal(v, i);
+				a = lval_add(a, x ? x : lval_eval_expr(e, v->cell[i]));
+			}
+			for (int i = 0; !result && i < a->count; i++) {
+				if (LTYPE(a->cell[i]) == LVAL_ERR) { result = lval_take(a, i); }
+			}
+			if (!result) { result = lform_builtin(form)(e, a); }
+			break;
+		}
+
+		// evaluate children into a new list
+		lval* a = lval_sexpr();
+		lval_reserve(a, v->count);
+		for (int i = 0; i < v->count; i++) {
+			lval* x = lval_eval_expr(e, v->cell[i]);
+			a->cell[a->count++] = x;
+		}
+		
+		// error checking
+		int err = -1;
+		for (int i = 0; i < a->count && err == -1; i++) {
+			if (LTYPE(a->cell[i]) == LVAL_ERR) { err = i; }
+		}
+		if (err != -1) { result = lval_take(a, err); break; }
+
+		// ensure first element is function
+		lval* f = lval_pop(a, 0);
+		if (LTYPE(f) != LVAL_FUN) {
+			result = lval_err(
+				"S-Expression starts with incorrect type. "
+				"Got %s, Expected %s.",
+				ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+			lval_del(f); lval_del(a);
+			break;
+		}
+
+		// eval and if continue with the Q-Expression they would evaluate
+		if (f->builtin == builtin_eval || f->builtin == builtin_if) {
+			lval* x = f->builtin == builtin_eval ? lval_eval_arg(a) : lval_if_branch(a);
+			lval_del(f);
+			if (LTYPE(x) == LVAL_ERR) { result = x; break; }
+			if (held) { lval_del(held); }
+			held = v = x;
+		
+		// lambdas continue with their body in the frame their arguments are bound in
+		} else if (!f->builtin) {
+			lenv* next;
+			result = lval_bind(e, f, a, &next);
+			if (result) { lval_del(f); break; }
+
+			// with --dynamic the new frame's parent may be the one being left
+			if (lenv_dynamic) { lenv_box(next); }
+			llet_unwind(lets);
+			if (frame) { lenv_release(frame); lval_del(fun); }
+			if (held) { lval_del(held); held = NULL; }
+			frame = e = next;
+			fun = f;
+			v = lval_target(f)->body;
+
+		// call function to get result
+		} else {
+			result = f->builtin(e, a);
+			lval_del(f);
+			break;
+		}
+
+		// every value is either owned by the heap or held here, so it is safe to collect
+		if (heap.pending) { lgc_collect_minor(); }
+	}
+
+	llet_unwind(lets);
+	if (frame) { lenv_release(frame); lval_del(fun); }
+	if (held) { lval_del(held); }
 	return result;
 }
 
+// the value of v in e, leaving v as it is
+lval* lval_eval_expr(lenv* e, lval* v) {
+	// every value is either owned by the heap or held by the evaluator here, so it is safe to collect
+	if (heap.pending) { lgc_collect_minor(); }
+	switch (LTYPE(v)) {
+		case LVAL_SYM: return lenv_get(e, v);
+		case LVAL_SEXPR: return lval_eval_sexpr(e, v);
+		default: return lval_ref(v);
+	}
+}
+
 lval* lval_eval(lenv* e, lval* v) {
-	if (v->type == LVAL_SYM) {
-		lval* x = lenv_get(e, v);
-		lval_del(v);
+	if (LTYPE(v) == LVAL_SEXPR && leval_mode == LEVAL_VM) { return lvm_eval(e, v); }
+	if (LTYPE(v) == LVAL_SEXPR && leval_mode == LEVAL_ANALYZE) { return lnode_eval(e, v); }
+	lval* x = lval_eval_expr(e, v);
+	lval_del(v);
+	return x;
+}
+
+// evaluate the children of the Q-Expression x as an S-Expression, leaving x as it is
+lval* lval_eval_qexpr(lenv* e, lval* x) {
+	if (leval_mode == LEVAL_VM) { return lvm_run(e, lval_code(x)); }
+	if (leval_mode == LEVAL_ANALYZE) { return lnode_run(lval_ref(lval_analysis(x)), e, NULL); }
+	return lval_eval_sexpr(e, x);
+}
+
+// move the cells of v to the start of a buffer with room for size of them
+void lval_resize(lval* v, int size) {
+	lval** base = v->cell - v->head;
+	lval** cell = size == v->size ? base : lcells_alloc(size);
+	if (v->count) { memmove(cell, v->cell, sizeof(lval*) * v->count); }
+	if (cell != base) { lcells_free(base, v->size); }
+	v->cell = cell;
+	v->size = size;
+	v->head = 0;
+}
+
+// give the view v cells of its own with room for n, so it can be changed
+void lval_unshare(lval* v, int n) {
+	lval* owner = v->owner;
+	int size = lcells_size(n > v->count ? n : v->count);
+	lval** cell = lcells_alloc(size);
+	for (int i = 0; i < v->count; i++) { cell[i] = lval_ref(v->cell[i]); }
+	v->view = 0;
+	v->cell = cell;
+	v->size = size;
+	v->head = 0;
+	lval_del(owner);
+}
+
+void lval_reserve(lval* v, int n) {
+	if (v->view) { lval_unshare(v, n); return; }
+	if (v->head + n <= v->size) { return; }
+
+	// when most of the buffer was freed by popping the front, slide the cells
+	// back down, the pops since the last move pay for it. otherwise grow
+	// geometrically so a run of appends only moves each cell a constant number of times
+	int size = v->size;
+	if (n > size / 2) { size = lcells_size(n > v->count * 2 ? n : v->count * 2); }
+	lval_resize(v, size);
+}
+
+lval* lval_slice(lval* v, int from, int n) {
+	lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+	if (n == 0) { return x; }
+
+	// a view keeps all of its owner alive, so a small part of a big list is copied instead
+	lval* owner = v->view ? v->owner : v;
+	if (owner->count > LCELLS_MAX && n < owner->count / 4) {
+		lval_reserve(x, n);
+		for (int i = 0; i < n; i++) { x->cell[i] = lval_ref(v->cell[from + i]); }
+		x->count = n;
 		return x;
 	}
-	if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-	return v;
+
+	// views always point at the list that really holds the cells
+	x->view = 1;
+	x->count = n;
+	x->cell = v->cell + from;
+	x->owner = lval_ref(owner);
+	return x;
 }
 
 lval* lval_pop(lval* v, int i) {
+	// a view can step over its front, anything else needs cells of its own
+	if (v->view && i != 0) { lval_reserve(v, v->count); }
+
 	// find the item at 'i'
 	lval* x = v->cell[i];
 
-	// shift memory after the item at 'i' over the top
-	memmove(&v->cell[i], &v->cell[i+1], 
-		sizeof(lval*) * (v->count-i-1));
+	if (v->view) {
+		// the owner keeps its reference, the caller gets another
+		lval_ref(x);
+		v->cell++;
+		v->count--;
+		if (v->count == 0) {
+			lval_del(v->owner);
+			v->view = 0;
+			v->cell = NULL;
+			v->head = 0;
+		} else if (v->owner->count > LCELLS_MAX && v->count < v->owner->count / 4) {
+			// copied for the same reason as in lval_slice, once it is a small part of the owner
+			lval_unshare(v, v->count);
+		}
+		return x;
+	}
+
+	if (i == 0) {
+		// popping the front just steps over it
+		v->cell++;
+		v->head++;
+	} else {
+		// shift memory after the item at 'i' over the top
+		memmove(&v->cell[i], &v->cell[i+1],
+			sizeof(lval*) * (v->count-i-1));
+	}
 
 	// decrease the count of items in the list
 	v->count--;
 
-	// reallocate the memory used
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	// give the memory back once the list is empty or mostly unused
+	if (v->count == 0) {
+		lcells_free(v->cell - v->head, v->size);
+		v->cell = NULL;
+		v->size = 0;
+		v->head = 0;
+	} else if (v->size > LCELLS_MAX && v->count < v->size / 4) {
+		lval_resize(v, lcells_size(v->count * 2));
+	}
 	return x;
 }
 
@@ -404,157 +1324,1065 @@ lval* lval_take(lval* v, int i) {
 	return x;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-  
-  /* If Builtin then simply apply that */
-  if (f->builtin) { return f->builtin(e, a); }
-  
-  /* Record Argument Counts */
-  int given = a->count;
-  int total = f->formals->count;
-  
-  /* While arguments still remain to be processed */
-  while (a->count) {
-    
-    /* If we've ran out of formal arguments to bind */
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err("Function passed too many arguments. "
-        "Got %i, Expected %i.", given, total); 
-    }
-    
-    /* Pop the first symbol from the formals */
-    lval* sym = lval_pop(f->formals, 0);
-    
-    /* Special Case to deal with '&' */
-    if (strcmp(sym->sym, "&") == 0) {
-      
-      /* Ensure '&' is followed by another symbol */
-      if (f->formals->count != 1) {
-        lval_del(a);
-        return lval_err("Function format invalid. "
-          "Symbol '&' not followed by single symbol.");
-      }
-      
-      /* Next formal should be bound to remaining arguments */
-      lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym); lval_del(nsym);
-      break;
-    }
-    
-    /* Pop the next argument from the list */
-    lval* val = lval_pop(a, 0);
-    
-    /* Bind a copy into the function's environment */
-    lenv_put(f->env, sym, val);
-    
-    /* Delete symbol and value */
-    lval_del(sym); lval_del(val);
+// bind the arguments a of the lambda f called from e. once every formal is bound
+// the frame to evaluate the body in is stored in *frame and NULL is returned,
+// otherwise the result is the partially applied function or an error
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** frame_out) {
+
+  /* A partial application binds the arguments it holds before the new ones */
+  lval* bound = NULL;
+  if (!f->env) {
+    bound = f->bound;
+    f = f->fun;
   }
-  
-  /* Argument list is now bound so can be cleaned up */
-  lval_del(a);
-  
-  /* If '&' remains in formal list bind to empty list */
-  if (f->formals->count > 0 &&
-    strcmp(f->formals->cell[0]->sym, "&") == 0) {
-    
-    /* Check to ensure that & is not passed invalidly. */
-    if (f->formals->count != 2) {
-      return lval_err("Function format invalid. "
-        "Symbol '&' not followed by single symbol.");
-    }
-    
-    /* Pop and delete '&' symbol */
-    lval_del(lval_pop(f->formals, 0));
-    
-    /* Pop next symbol and create empty list */
-    lval* sym = lval_pop(f->formals, 0);
-    lval* val = lval_qexpr();
-    
-    /* Bind to environment and delete */
-    lenv_put(f->env, sym, val);
-    lval_del(sym); lval_del(val);
+  int held = bound ? bound->count : 0;
+  int given = held + a->count;
+
+  if (given > f->arity && !f->rest) {
+    lval_del(a);
+    return lval_err("Function passed too many arguments. "
+      "Got %i, Expected %i.", given, f->arity);
   }
-  
-  /* If all formals have been bound evaluate */
-  if (f->formals->count == 0) {
-  
-    /* Set environment parent to evaluation environment */
-    f->env->par = e;
-    
-    /* Evaluate and return */
-    return builtin_eval(f->env, 
-      lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    /* Otherwise return partially evaluated function */
-    return lval_copy(f);
+
+  /* Too few arguments, hold on to them until the others arrive */
+  if (given < f->arity) {
+    a->type = LVAL_QEXPR;
+    if (bound) { a = lval_join(lval_own(lval_ref(bound)), a); }
+    return lval_partial(f, a);
   }
-  
+
+  /* Each call binds its arguments in a fresh frame inside the environment the
+   * lambda was created in, in the order of the formals */
+  lenv* frame = lenv_new();
+  frame->par = f->env;
+  lval* formals = f->formals;
+  for (int i = 0; i < f->arity; i++) {
+    lval* val = i < held ? lval_ref(bound->cell[i]) : lval_pop(a, 0);
+    lenv_put(frame, formals->cell[i], val);
+    lval_del(val);
+  }
+
+  /* The symbol after '&' gets whatever is left, which may be nothing */
+  if (f->rest) { lenv_put(frame, formals->cell[f->arity + 1], builtin_list(e, a)); }
+  lval_del(a);
+
+  /* With --dynamic the frame sits in the caller's environment instead */
+  if (lenv_dynamic) { frame->par = e; }
+  *frame_out = frame;
+  return NULL;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+lval* lval_call(lenv* e, lval* f, lval* a) {
   
-  	for (int i = 0; i < a->count; i++) {
-		LASSERT_TYPE(op, a, i, LVAL_NUM);
- 	}
+  /* If Builtin then simply apply that */
+  if (f->builtin) { return f->builtin(e, a); }
 
-	// pop the first element
-	lval* x = lval_pop(a, 0);
+  lenv* frame;
+  lval* result = lval_bind(e, f, a, &frame);
+  if (result) { return result; }
 
-	// if no arguments and sub then perform unary negation
-	if ((strcmp(op, "-") == 0) && (a->count == 0)) {
-		x->num = -x->num;
-	}
+  /* Evaluate, then drop the frame unless something captured it */
+  result = lval_eval_qexpr(frame, lval_target(f)->body);
+  lenv_release(frame);
+  return result;
+}
 
-	// while there are still elements remaining
-	while (a->count > 0) {
-		
-		//pop the next element
-		lval* y = lval_pop(a, 0);
-
-		if ((strcmp(op, "+") == 0) || (strcmp(op, "add") == 0)) { x->num += y->num; }
-		if ((strcmp(op, "-") == 0) || (strcmp(op, "sub") == 0)) { x->num -= y->num; }
-		if ((strcmp(op, "*") == 0) || (strcmp(op, "mul") == 0)) { x->num *= y->num; }
-		if ((strcmp(op, "/") == 0) || (strcmp(op, "div") == 0)) { 
-			if (y->num == 0) {
-				lval_del(x); lval_del(y);
-				x = lval_err("Division By Zero!"); break;
+/* Compiler
+ *
+ * an S-Expression compiles to code that pushes the value of each child onto
+ * the VM's stack and then calls the first with the rest, exactly as
+ * lval_eval_sexpr would. symbols become loads from a frame slot when
+ * lval_resolve placed them in one and name lookups otherwise, everything else
+ * is a constant. if and let compile their branches and body inline, def, =
+ * and \ compile to a call to their builtin held as a constant
+ */
+enum {
+	OP_CONST,  // k: push constant k
+	OP_LOCAL,  // k slot: push symbol k from slot of the frame, looking it up if it is not there
+	OP_SYM,    // k: push the value symbol k is bound to
+	OP_CALL,   // n: call the n values on top of the stack as an S-Expression
+	OP_TAILCALL, // n: call as the last thing the frame does, lambdas and eval replace the frame
+	OP_LAZYCALL, // n pos: call, making a map or filter that is argument pos of the call below it lazily
+	OP_IF,     // else end: pop the condition and continue at else if it is 0, or push
+	           // the error if it is not a number and continue at end
+	OP_LET,    // start a let, its frame becomes the environment
+	OP_BIND,   // k end: bind symbol k to the value popped in the let's frame, or continue at
+	           // end if it is an error
+	OP_ENDLET, // end the let, returning to the environment it started in
+	OP_JUMP,   // to: continue at to
+	OP_RETURN  // return the top of the stack
+};
+
+struct lcompiler {
+	int* ops;
+	int nops;
+	int sops;
+	lval** consts;
+	int nconsts;
+	int sconsts;
+	lnode* nodes; // when analyzing instead
+	int nnodes;
+	int snodes;
+};
+
+void lcomp_op(struct lcompiler* c, int op) {
+	if (c->nops == c->sops) {
+		c->sops = c->sops ? c->sops * 2 : 16;
+		c->ops = realloc(c->ops, sizeof(int) * c->sops);
+	}
+	c->ops[c->nops++] = op;
+}
+
+// add a reference to v to the constant pool, returns its index
+int lcomp_const(struct lcompiler* c, lval* v) {
+	if (c->nconsts == c->sconsts) {
+		c->sconsts = c->sconsts ? c->sconsts * 2 : 8;
+		c->consts = realloc(c->consts, sizeof(lval*) * c->sconsts);
+	}
+	c->consts[c->nconsts] = lval_ref(v);
+	return c->nconsts++;
+}
+
+void lcomp_sexpr(struct lcompiler* c, lval* v, int tail);
+void lcomp_call(struct lcompiler* c, lval* v, int op, int pos);
+void lcomp_body(struct lcompiler* c, lval* v, int tail);
+
+// code pushing the value of v
+void lcomp_expr(struct lcompiler* c, lval* v) {
+	switch (LTYPE(v)) {
+		case LVAL_SYM:
+			if (v->depth == 0) {
+				lcomp_op(c, OP_LOCAL);
+				lcomp_op(c, lcomp_const(c, v));
+				lcomp_op(c, v->slot);
+			} else {
+				lcomp_op(c, OP_SYM);
+				lcomp_op(c, lcomp_const(c, v));
+			}
+		break;
+		case LVAL_SEXPR: lcomp_sexpr(c, v, 0); break;
+		default:
+			lcomp_op(c, OP_CONST);
+			lcomp_op(c, lcomp_const(c, v));
+		break;
+	}
+}
+
+// code pushing the value of the children of v evaluated as an S-Expression,
+// or returning it when v is in tail position
+void lcomp_sexpr(struct lcompiler* c, lval* v, int tail) {
+
+	// empty expr evaluates to an empty S-Expression
+	if (v->count == 0) {
+		lval* x = lval_sexpr();
+		lcomp_op(c, OP_CONST);
+		lcomp_op(c, lcomp_const(c, x));
+		lval_del(x);
+
+	// single expression evaluates to itself
+	} else if (v->count == 1) {
+		lcomp_expr(c, v->cell[0]);
+
+	// if
+	} else if (lval_form(v) == LFORM_IF) {
+		lcomp_expr(c, v->cell[1]);
+		lcomp_op(c, OP_IF);
+		int jelse = c->nops;
+		lcomp_op(c, 0);
+		int jend = c->nops;
+		lcomp_op(c, 0);
+
+		lcomp_body(c, v->cell[2], tail);
+		int jthen = -1;
+		if (!tail) {
+			lcomp_op(c, OP_JUMP);
+			jthen = c->nops;
+			lcomp_op(c, 0);
+		}
+		c->ops[jelse] = c->nops;
+		lcomp_body(c, v->cell[3], tail);
+		c->ops[jend] = c->nops;
+		if (jthen != -1) { c->ops[jthen] = c->nops; }
+
+	// let, in tail position its frame ends along with the VM frame
+	} else if (lval_form(v) == LFORM_LET) {
+		lval* err = llet_check(v);
+		if (err) {
+			lcomp_op(c, OP_CONST);
+			lcomp_op(c, lcomp_const(c, err));
+			lval_del(err);
+		} else {
+			lval* b = v->cell[1];
+			int* jend = malloc(sizeof(int) * (b->count + 1));
+			lcomp_op(c, OP_LET);
+			for (int i = 0; i < b->count; i++) {
+				lcomp_expr(c, b->cell[i]->cell[1]);
+				lcomp_op(c, OP_BIND);
+				lcomp_op(c, lcomp_const(c, b->cell[i]->cell[0]));
+				jend[i] = c->nops;
+				lcomp_op(c, 0);
+			}
+			lcomp_body(c, v->cell[2], tail);
+			for (int i = 0; i < b->count; i++) { c->ops[jend[i]] = c->nops; }
+			if (!tail) { lcomp_op(c, OP_ENDLET); }
+			free(jend);
 		}
-		x->num /= y->num;
+
+	// def, = and \ call their builtin directly
+	} else if (lval_form(v) != LFORM_NONE) {
+		lval* f = lval_fun(lform_builtin(lval_form(v)));
+		lcomp_op(c, OP_CONST);
+		lcomp_op(c, lcomp_const(c, f));
+		lval_del(f);
+		for (int i = 1; i < v->count; i++) {
+			lval* x = lform_literal(v, i);
+			if (x) {
+				lcomp_op(c, OP_CONST);
+				lcomp_op(c, lcomp_const(c, x));
+				lval_del(x);
+			} else {
+				lcomp_expr(c, v->cell[i]);
+			}
 		}
-		
-		lval_del(y);
+		lcomp_op(c, OP_CALL);
+		lcomp_op(c, v->count);
+
+	// anything else is a call
+	} else {
+		lcomp_call(c, v, tail ? OP_TAILCALL : OP_CALL, 0);
 	}
 
-	lval_del(a);
+	if (tail) { lcomp_op(c, OP_RETURN); }
+}
+
+// code for the call v ending in op. which function is called is only known when
+// it runs, so with --fuse any call with two arguments from the third on could be
+// a map or filter another builtin reads through, and is made with OP_LAZYCALL
+void lcomp_call(struct lcompiler* c, lval* v, int op, int pos) {
+	for (int i = 0; i < v->count; i++) {
+		lval* x = v->cell[i];
+		if (lfuse && i >= 2 && LTYPE(x) == LVAL_SEXPR && x->count == 3 && LTYPE(x->cell[0]) == LVAL_SYM
+			&& lval_form(x) == LFORM_NONE) {
+			lcomp_call(c, x, OP_LAZYCALL, i);
+		} else {
+			lcomp_expr(c, x);
+		}
+	}
+	lcomp_op(c, op);
+	lcomp_op(c, v->count);
+	if (op == OP_LAZYCALL) { lcomp_op(c, pos); }
+}
+
+// code for an if branch or let body, written as an expression it is evaluated
+// as one, otherwise its children are
+void lcomp_body(struct lcompiler* c, lval* v, int tail) {
+	if (LTYPE(v) == LVAL_QEXPR || LTYPE(v) == LVAL_SEXPR) {
+		lcomp_sexpr(c, v, tail);
+		return;
+	}
+	lcomp_expr(c, v);
+	if (tail) { lcomp_op(c, OP_RETURN); }
+}
+
+// compile the children of v as an S-Expression
+lval* lval_compile(lval* v) {
+	struct lcompiler c = { NULL, 0, 0, NULL, 0, 0, NULL, 0, 0 };
+	lcomp_sexpr(&c, v, 1);
+
+	lval* x = lval_alloc(LVAL_CODE);
+	x->ops = realloc(c.ops, sizeof(int) * c.nops);
+	x->nops = c.nops;
+	x->consts = c.consts;
+	x->nconsts = c.nconsts;
+	x->nodes = NULL;
 	return x;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+// the code for the expression v, compiled the first time it is needed
+lval* lval_code(lval* v) {
+	if (v->code && v->code->nodes) { lval_del(v->code); v->code = NULL; }
+	if (!v->code) { v->code = lval_compile(v); }
+	return v->code;
+}
+
+/* VM
+ *
+ * a stack machine running compiled code. calling a lambda, eval or if pushes
+ * a frame instead of recursing in C, so only builtins that evaluate code
+ * themselves nest a new run of the VM. values on the stack and the code and
+ * function of each frame are held by reference.
+ *
+ * recursion deeper than --max-depth frames, or builtins nesting runs more than
+ * LVM_MAX_RUNS deep, evaluate to an error rather than exhausting memory or
+ * the C stack
+ */
+#define LVM_MAX_RUNS 1000
+
+struct lframe {
+	lval* code;
+	int ip;
+	lenv* env;
+	lval* fun; // the lambda whose call created env, both released on return, or NULL if env is borrowed
+	int lets;  // lets started before the frame, those after are ended with it
+};
+
+struct lvm {
+	lval** stack;
+	int sp;
+	int size;
+	struct lframe* frames;
+	int fp;
+	int fsize;
+	int runs; // runs of the VM nested on the C stack
+};
+
+struct lvm lvm;
+
+void lvm_push(lval* v) {
+	if (lvm.sp == lvm.size) {
+		lvm.size = lvm.size ? lvm.size * 2 : 256;
+		lvm.stack = realloc(lvm.stack, sizeof(lval*) * lvm.size);
+	}
+	lvm.stack[lvm.sp++] = v;
+}
+
+void lvm_enter(lval* code, lenv* env, lval* fun) {
+	if (lvm.fp == lvm.fsize) {
+		lvm.fsize = lvm.fsize ? lvm.fsize * 2 : 64;
+		lvm.frames = realloc(lvm.frames, sizeof(struct lframe) * lvm.fsize);
+	}
+	struct lframe* f = &lvm.frames[lvm.fp++];
+	f->code = lval_ref(code);
+	f->ip = 0;
+	f->env = env;
+	f->fun = fun;
+	f->lets = llets.count;
+}
+
+void lvm_leave(void) {
+	struct lframe* f = &lvm.frames[--lvm.fp];
+	lval_del(f->code);
+
+	// inside a let, the frame's own environment is the parent of its first
+	if (llets.count > f->lets) {
+		f->env = llets.chunks[f->lets / LLETS_CHUNK][f->lets % LLETS_CHUNK].par;
+		llet_unwind(f->lets);
+	}
+	if (f->fun) {
+		lenv_release(f->env);
+		lval_del(f->fun);
+	}
+}
+
+// continue with code in e, in a new frame or for a tail call in the current one
+void lvm_continue(lval* code, lenv* e, int tail) {
+	if (tail) {
+		struct lframe* fr = &lvm.frames[lvm.fp - 1];
+		lval_ref(code);
+		lval_del(fr->code);
+		fr->code = code;
+		fr->ip = 0;
+	} else {
+		lvm_enter(code, e, NULL);
+	}
+}
+
+// release the n values on top of the stack
+void lvm_drop(int n) {
+	while (n--) { lval_del(lvm.stack[--lvm.sp]); }
+}
+
+// release the n values on top of the stack and push x in their place
+void lvm_replace(int n, lval* x) {
+	lvm_drop(n);
+	lvm_push(x);
+}
+
+// take the top n values off the stack as the cells of an S-Expression
+lval* lvm_args(int n) {
+	lval* a = lval_sexpr();
+	lval_reserve(a, n);
+	a->count = n;
+	lvm.sp -= n;
+	for (int i = 0; i < n; i++) { a->cell[i] = lvm.stack[lvm.sp + i]; }
+	return a;
+}
+
+// call the n values on top of the stack, pushing the result or entering a new frame.
+// a tail call replaces the current frame instead, so loops written as recursion run
+// in constant space
+void lvm_call(lenv* e, int n, int tail) {
+	lval** v = &lvm.stack[lvm.sp - n];
+
+	// error checking, the first error is the result
+	for (int i = 0; i < n; i++) {
+		if (LTYPE(v[i]) == LVAL_ERR) {
+			lvm_replace(n, lval_ref(v[i]));
+			return;
+		}
+	}
+
+	// ensure first element is function
+	lval* f = v[0];
+	if (LTYPE(f) != LVAL_FUN) {
+		lvm_replace(n, lval_err(
+			"S-Expression starts with incorrect type. "
+			"Got %s, Expected %s.",
+			ltype_name(LTYPE(f)), ltype_name(LVAL_FUN)));
+		return;
+	}
+
+	// anything but a builtin needs a new frame unless it is a tail call
+	if (!tail && lvm.fp >= lvm_max_depth && (!f->builtin || f->builtin == builtin_eval || f->builtin == builtin_if)) {
+		lvm_replace(n, lval_err("Maximum recursion depth of %i exceeded.", lvm_max_depth));
+		return;
+	}
+
+	// eval of a Q-Expression runs its code in this environment
+	if (f->builtin == builtin_eval && n == 2 && LTYPE(v[1]) == LVAL_QEXPR) {
+		lvm_continue(lval_code(v[1]), e, tail);
+		lvm_drop(2);
+		return;
+	}
+
+	// so does if, with the branch it takes
+	if (f->builtin == builtin_if && n == 4 && LTYPE(v[1]) == LVAL_NUM
+		&& LTYPE(v[2]) == LVAL_QEXPR && LTYPE(v[3]) == LVAL_QEXPR) {
+		lvm_continue(lval_code(LNUM(v[1]) ? v[2] : v[3]), e, tail);
+		lvm_drop(4);
+		return;
+	}
+
+	// two small numbers through an arithmetic kernel need no argument list
+	if (f->builtin && n == 3) {
+		lval* r = lval_binary(f->builtin, v[1], v[2]);
+		if (r) {
+			lvm_replace(n, r);
+			return;
+		}
+	}
+
+	lval* a = lvm_args(n - 1);
+	lvm.sp--;
+	if (f->builtin) {
+		lvm_push(f->builtin(e, a));
+		lval_del(f);
+		return;
+	}
+
+	// lambdas run in the frame their arguments are bound in
+	lenv* frame;
+	lval* r = lval_bind(e, f, a, &frame);
+	if (r) {
+		lvm_push(r);
+		lval_del(f);
+		return;
+	}
+	if (tail) {
+		// with --dynamic the new frame's parent may be the one being left
+		if (lenv_dynamic) { lenv_box(frame); }
+		lvm_leave();
+	}
+	lvm_enter(lval_code(lval_target(f)->body), frame, f);
+}
+
+// call the n values on top of the stack, unless they are a map or filter that the
+// builtin pos values below them reads through, which is made lazily instead
+void lvm_lazy(lenv* e, int n, int pos) {
+	lval** v = &lvm.stack[lvm.sp - n];
+	lval* f = v[0];
+	lval* g = v[-pos];
+	if (n != 3 || LTYPE(f) != LVAL_FUN || LTYPE(g) != LVAL_FUN
+		|| !lfuse_lazy(f->builtin) || lfuse_pos(g->builtin) != pos) {
+		lvm_call(e, n, 0);
+		return;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (LTYPE(v[i]) == LVAL_ERR) {
+			lvm_replace(n, lval_ref(v[i]));
+			return;
+		}
+	}
+	lval* a = lvm_args(n - 1);
+	lvm.sp--;
+	lvm_push(lfuse_call(e, f->builtin, a));
+	lval_del(f);
+}
+
+// run code in e until it returns
+lval* lvm_run(lenv* e, lval* code) {
+	if (lvm.runs == LVM_MAX_RUNS) {
+		return lval_err("Maximum nesting of evaluation exceeded.");
+	}
+	lvm.runs++;
+	int base = lvm.fp;
+	lvm_enter(code, e, NULL);
+
+	while (1) {
+		struct lframe* fr = &lvm.frames[lvm.fp - 1];
+		int* ops = fr->code->ops;
+		lval** k = fr->code->consts;
+		int ip = fr->ip;
+
+		switch (ops[ip++]) {
+			case OP_CONST:
+				lvm_push(lval_ref(k[ops[ip++]]));
+			break;
+			case OP_LOCAL: {
+				lval* sym = k[ops[ip++]];
+				int slot = ops[ip++];
+				lenv* env = fr->env;
+				if (slot < env->count && env->syms[slot] == sym->sym) {
+					lvm_push(lval_ref(env->vals[slot]));
+				} else {
+					lvm_push(lenv_get(env, sym));
+				}
+			}
+			break;
+			case OP_SYM:
+				lvm_push(lenv_get(fr->env, k[ops[ip++]]));
+			break;
+			case OP_CALL:
+			case OP_TAILCALL:
+				fr->ip = ip + 1;
+				// every value is held by the stack or the heap here, so it is safe to collect
+				if (heap.pending) { lgc_collect_minor(); }
+				lvm_call(fr->env, ops[ip], ops[ip - 1] == OP_TAILCALL);
+			continue;
+			case OP_LAZYCALL:
+				fr->ip = ip + 2;
+				if (heap.pending) { lgc_collect_minor(); }
+				lvm_lazy(fr->env, ops[ip], ops[ip + 1]);
+			continue;
+			case OP_IF: {
+				lval* cond = lvm.stack[--lvm.sp];
+				lval* err = lif_check(cond);
+				if (err) {
+					lvm_push(err);
+					ip = ops[ip + 1];
+				} else {
+					ip = LNUM(cond) ? ip + 2 : ops[ip];
+				}
+				lval_del(cond);
+			}
+			break;
+			case OP_LET:
+				fr->env = llet_push(fr->env);
+			break;
+			case OP_BIND: {
+				lval* x = lvm.stack[lvm.sp - 1];
+				if (LTYPE(x) == LVAL_ERR) {
+					ip = ops[ip + 1];
+				} else {
+					lenv_put(fr->env, k[ops[ip]], x);
+					lvm_drop(1);
+					ip += 2;
+				}
+			}
+			break;
+			case OP_ENDLET:
+				fr->env = fr->env->par;
+				llet_unwind(llets.count - 1);
+			break;
+			case OP_JUMP:
+				ip = ops[ip];
+			break;
+			case OP_RETURN: {
+				lvm_leave();
+				if (lvm.fp == base) {
+					lvm.runs--;
+					return lvm.stack[--lvm.sp];
+				}
+			}
+			continue;
+		}
+		fr->ip = ip;
+	}
+}
+
+// evaluate the S-Expression v in e on the VM
+lval* lvm_eval(lenv* e, lval* v) {
+	lval* code = lval_compile(v);
+	lval_del(v);
+	lval* r = lvm_run(e, code);
+	lval_del(code);
+	return r;
+}
+
+/* Analysis
+ *
+ * --analyze runs expressions the way SICP's analyzing evaluator does. each
+ * expression is analyzed once into a tree of nodes that know how to execute
+ * themselves, so calling a lambda never dispatches on the type of its body,
+ * copies it or looks into its Q-Expressions again. symbols lval_resolve
+ * placed in a frame slot become slot loads, calls to a symbol bound to a
+ * builtin when the body was analyzed call that builtin directly for as long
+ * as the symbol still is, and special forms execute their branches and
+ * bodies in place. the tree is kept as the expression's code like the VM's bytecode,
+ * its nodes referring to values through the code's constants.
+ *
+ * a call in tail position leaves what it would run in ltail and returns
+ * LTAIL instead of running it, lnode_run then runs it in place of the code
+ * it was called from, so loops written as recursion run in constant space
+ */
+struct lnode {
+	lval* (*exec)(lnode* n, lenv* e);
+	lval* val;        // constant or symbol
+	lbuiltin builtin; // builtin a call calls directly
+	int slot;         // frame slot of a local symbol
+	int tail;         // the call is the last thing its code does
+	int count;        // children of a call or special form
+	int first;        // index of the first child, while analyzing
+	lnode* kids;
+};
+
+struct ltail {
+	lval* code;
+	lenv* env;
+	lval* fun; // the lambda whose call created env, or NULL if env is borrowed
+};
+
+struct ltail ltail;
+lval lnode_tail;
+#define LTAIL (&lnode_tail)
+
+// run code or, as a tail call, leave it to lnode_run. takes the reference to
+// code, and ownership of e and fun when fun is not NULL
+lval* lnode_continue(lval* code, lenv* e, lval* fun, int tail) {
+	if (!tail) { return lnode_run(code, e, fun); }
+	ltail.code = code;
+	ltail.env = e;
+	ltail.fun = fun;
+	return LTAIL;
+}
+
+// call the evaluated children a of the call n
+lval* lnode_apply(lnode* n, lenv* e, lval* a) {
+
+	// error checking, the first error is the result
+	for (int i = 0; i < a->count; i++) {
+		if (LTYPE(a->cell[i]) == LVAL_ERR) { return lval_take(a, i); }
+	}
+
+	// ensure first element is function
+	lval* f = lval_pop(a, 0);
+	if (LTYPE(f) != LVAL_FUN) {
+		lval* err = lval_err(
+			"S-Expression starts with incorrect type. "
+			"Got %s, Expected %s.",
+			ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+		lval_del(f); lval_del(a);
+		return err;
+	}
+
+	// eval of a Q-Expression, and if with the branch it takes, run its analysis in this environment
+	lval* code = NULL;
+	if (f->builtin == builtin_eval && a->count == 1 && LTYPE(a->cell[0]) == LVAL_QEXPR) {
+		code = lval_analysis(a->cell[0]);
+	} else if (f->builtin == builtin_if && a->count == 3 && LTYPE(a->cell[0]) == LVAL_NUM
+		&& LTYPE(a->cell[1]) == LVAL_QEXPR && LTYPE(a->cell[2]) == LVAL_QEXPR) {
+		code = lval_analysis(LNUM(a->cell[0]) ? a->cell[1] : a->cell[2]);
+	}
+	if (code) {
+		lval_ref(code);
+		lval_del(a); lval_del(f);
+		return lnode_continue(code, e, NULL, n->tail);
+	}
+
+	if (f->builtin) {
+		lval* r = f->builtin(e, a);
+		lval_del(f);
+		return r;
+	}
+
+	// lambdas run their body's analysis in the frame their arguments are bound in
+	lenv* frame;
+	lval* r = lval_bind(e, f, a, &frame);
+	if (r) { lval_del(f); return r; }
+	return lnode_continue(lval_ref(lval_analysis(lval_target(f)->body)), frame, f, n->tail);
+}
+
+lval* lnode_const(lnode* n, lenv* e) {
+	return lval_ref(n->val);
+}
+
+lval* lnode_local(lnode* n, lenv* e) {
+	if (n->slot < e->count && e->syms[n->slot] == n->val->sym) { return lval_ref(e->vals[n->slot]); }
+	return lenv_get(e, n->val);
+}
+
+lval* lnode_sym(lnode* n, lenv* e) {
+	return lenv_get(e, n->val);
+}
+
+// evaluate children from the first'th on into an S-Expression
+lval* lnode_args(lnode* n, lenv* e, int first) {
+	// every value is either owned by the heap or held here, so it is safe to collect
+	if (heap.pending) { lgc_collect_minor(); }
+	lval* a = lval_sexpr();
+	lval_reserve(a, n->count - first);
+	for (int i = first; i < n->count; i++) {
+		lval* x = n->kids[i].exec(&n->kids[i], e);
+		a->cell[a->count++] = x;
+	}
+	return a;
+}
+
+lval* lnode_call(lnode* n, lenv* e) {
+	return lnode_apply(n, e, lnode_args(n, e, 0));
+}
+
+lval* lnode_lazy(lnode* n, lenv* e);
+
+// evaluate the arguments of a call to a builtin known when analyzing, the first
+// error if there is one. the one at slot (when it is not 0) is a map or filter
+// made lazily, see Fusion
+lval* lnode_operands(lnode* n, lenv* e) {
+	// every value is either owned by the heap or held here, so it is safe to collect
+	if (heap.pending) { lgc_collect_minor(); }
+	lval* a = lval_sexpr();
+	lval_reserve(a, n->count - 1);
+	for (int i = 1; i < n->count; i++) {
+		lnode* k = &n->kids[i];
+		a->cell[a->count++] = i == n->slot ? lnode_lazy(k, e) : k->exec(k, e);
+	}
+	for (int i = 0; i < a->count; i++) {
+		if (LTYPE(a->cell[i]) == LVAL_ERR) { return lval_take(a, i); }
+	}
+	return a;
+}
+
+// call to a builtin known when analyzing, without evaluating the head
+lval* lnode_direct(lnode* n, lenv* e) {
+	lval* a = lnode_operands(n, e);
+	if (LTYPE(a) == LVAL_ERR) { return a; }
+	return n->builtin(e, a);
+}
+
+// whether the head symbol is still bound to the builtin it was when analyzing
+int lnode_bound(lnode* n) {
+	lsym* s = n->val->sym;
+	lval* f;
+	return !s->local && s->genv && LTYPE(f = s->genv->vals[s->gslot]) == LVAL_FUN && f->builtin == n->builtin;
+}
+
+// call to the builtin the head symbol was bound to, or any call once it is not
+lval* lnode_builtin(lnode* n, lenv* e) {
+	if (!lnode_bound(n)) { return lnode_call(n, e); }
+	return lnode_direct(n, e);
+}
+
+// the same with two arguments, which need no argument list when lval_binary takes them
+lval* lnode_binary(lnode* n, lenv* e) {
+	if (!lnode_bound(n)) { return lnode_call(n, e); }
+	// nothing is held yet, so it is safe to collect
+	if (heap.pending) { lgc_collect_minor(); }
+	lval* x = n->kids[1].exec(&n->kids[1], e);
+	lval* y = n->kids[2].exec(&n->kids[2], e);
+	lval* r = lval_binary(n->builtin, x, y);
+	if (r) { return r; }
+
+	if (LTYPE(x) == LVAL_ERR) { lval_del(y); return x; }
+	if (LTYPE(y) == LVAL_ERR) { lval_del(x); return y; }
+	lval* a = lval_sexpr();
+	lval_reserve(a, 2);
+	a->cell[a->count++] = x;
+	a->cell[a->count++] = y;
+	return n->builtin(e, a);
+}
+
+// a map or filter node analyzed as the argument of a call that reads it through,
+// made lazily while it is still bound to the builtin
+lval* lnode_lazy(lnode* n, lenv* e) {
+	if (!lnode_bound(n)) { return n->exec(n, e); }
+	lval* a = lnode_operands(n, e);
+	if (LTYPE(a) == LVAL_ERR) { return a; }
+	return lfuse_call(e, n->builtin, a);
+}
+
+lval* lnode_if(lnode* n, lenv* e) {
+	lval* c = n->kids[0].exec(&n->kids[0], e);
+	lval* err = lif_check(c);
+	if (err) { lval_del(c); return err; }
+	lnode* b = &n->kids[LNUM(c) ? 1 : 2];
+	lval_del(c);
+	return b->exec(b, e);
+}
+
+// children are pairs of a symbol and the node for its value, then the body
+lval* lnode_let(lnode* n, lenv* e) {
+	int lets = llets.count;
+	e = llet_push(e);
+	for (int i = 0; i + 1 < n->count; i += 2) {
+		lval* x = n->kids[i + 1].exec(&n->kids[i + 1], e);
+		if (LTYPE(x) == LVAL_ERR) { llet_unwind(lets); return x; }
+		lenv_put(e, n->kids[i].val, x);
+		lval_del(x);
+	}
+
+	// in tail position the body may continue in the let's frame, lnode_run ends it instead
+	lnode* b = &n->kids[n->count - 1];
+	lval* r = b->exec(b, e);
+	if (!n->tail) { llet_unwind(lets); }
+	return r;
+}
+
+// reserve n consecutive nodes, returns the index of the first
+int lana_nodes(struct lcompiler* c, int n) {
+	while (c->nnodes + n > c->snodes) {
+		c->snodes = c->snodes ? c->snodes * 2 : 16;
+		c->nodes = realloc(c->nodes, sizeof(lnode) * c->snodes);
+	}
+	memset(&c->nodes[c->nnodes], 0, sizeof(lnode) * n);
+	c->nnodes += n;
+	return c->nnodes - n;
+}
+
+// add a reference to v to the constant pool, returns it
+lval* lana_const(struct lcompiler* c, lval* v) {
+	int k = lcomp_const(c, v);
+	return c->consts[k];
+}
+
+void lana_sexpr(struct lcompiler* c, int i, lval* v, int tail);
+void lana_body(struct lcompiler* c, int i, lval* v, int tail);
+
+// analyze v into node i. nodes move as more are reserved, so they are always found by index
+void lana_expr(struct lcompiler* c, int i, lval* v) {
+	switch (LTYPE(v)) {
+		case LVAL_SYM:
+			c->nodes[i].val = lana_const(c, v);
+			if (v->depth == 0) {
+				c->nodes[i].exec = lnode_local;
+				c->nodes[i].slot = v->slot;
+			} else {
+				c->nodes[i].exec = lnode_sym;
+			}
+		break;
+		case LVAL_SEXPR: lana_sexpr(c, i, v, 0); break;
+		default:
+			c->nodes[i].exec = lnode_const;
+			c->nodes[i].val = lana_const(c, v);
+		break;
+	}
+}
+
+// analyze the children of v evaluated as an S-Expression into node i
+void lana_sexpr(struct lcompiler* c, int i, lval* v, int tail) {
+
+	// empty expr evaluates to an empty S-Expression
+	if (v->count == 0) {
+		lval* x = lval_sexpr();
+		c->nodes[i].exec = lnode_const;
+		c->nodes[i].val = lana_const(c, x);
+		lval_del(x);
+
+	// single expression evaluates to itself
+	} else if (v->count == 1) {
+		if (LTYPE(v->cell[0]) == LVAL_SEXPR) { lana_sexpr(c, i, v->cell[0], tail); }
+		else { lana_expr(c, i, v->cell[0]); }
+
+	// if
+	} else if (lval_form(v) == LFORM_IF) {
+		int k = lana_nodes(c, 3);
+		lana_expr(c, k, v->cell[1]);
+		lana_body(c, k + 1, v->cell[2], tail);
+		lana_body(c, k + 2, v->cell[3], tail);
+		c->nodes[i].exec = lnode_if;
+		c->nodes[i].first = k;
+		c->nodes[i].count = 3;
+
+	// let
+	} else if (lval_form(v) == LFORM_LET) {
+		lval* err = llet_check(v);
+		if (err) {
+			c->nodes[i].exec = lnode_const;
+			c->nodes[i].val = lana_const(c, err);
+			lval_del(err);
+			return;
+		}
+		lval* b = v->cell[1];
+		int k = lana_nodes(c, b->count * 2 + 1);
+		for (int j = 0; j < b->count; j++) {
+			c->nodes[k + j * 2].val = lana_const(c, b->cell[j]->cell[0]);
+			lana_expr(c, k + j * 2 + 1, b->cell[j]->cell[1]);
+		}
+		lana_body(c, k + b->count * 2, v->cell[2], tail);
+		lnode* n = &c->nodes[i];
+		n->exec = lnode_let;
+		n->first = k;
+		n->count = b->count * 2 + 1;
+		n->tail = tail;
+
+	// def, = and \ call their builtin directly
+	} else if (lval_form(v) != LFORM_NONE) {
+		int k = lana_nodes(c, v->count);
+		for (int j = 1; j < v->count; j++) {
+			lval* x = lform_literal(v, j);
+			if (x) {
+				c->nodes[k + j].exec = lnode_const;
+				c->nodes[k + j].val = lana_const(c, x);
+				lval_del(x);
+			} else {
+				lana_expr(c, k + j, v->cell[j]);
+			}
+		}
+		lnode* n = &c->nodes[i];
+		n->exec = lnode_direct;
+		n->builtin = lform_builtin(lval_form(v));
+		n->first = k;
+		n->count = v->count;
+
+	// anything else is a call
+	} else {
+		int k = lana_nodes(c, v->count);
+		for (int j = 0; j < v->count; j++) { lana_expr(c, k + j, v->cell[j]); }
+		lnode* n = &c->nodes[i];
+		n->exec = lnode_call;
+		n->first = k;
+		n->count = v->count;
+		n->tail = tail;
+
+		// a global symbol bound to a builtin is called directly
+		lval* h = v->cell[0];
+		if (LTYPE(h) == LVAL_SYM && !h->sym->local && h->sym->genv) {
+			lval* f = h->sym->genv->vals[h->sym->gslot];
+			if (LTYPE(f) == LVAL_FUN && f->builtin && f->builtin != builtin_eval && f->builtin != builtin_if) {
+				n->exec = v->count == 3 ? lnode_binary : lnode_builtin;
+				n->builtin = f->builtin;
+				n->val = c->nodes[k].val;
+
+				// with --fuse a map or filter in the argument it reads through is made lazily
+				int pos = lfuse ? lfuse_pos(f->builtin) : 0;
+				if (pos && pos < v->count && lfuse_lazy(c->nodes[k + pos].builtin) && c->nodes[k + pos].count == 3) {
+					n->exec = lnode_builtin;
+					n->slot = pos;
+				}
+			}
+		}
+	}
+}
+
+// analyze an if branch or let body into node i, written as an expression it is
+// evaluated as one, otherwise its children are
+void lana_body(struct lcompiler* c, int i, lval* v, int tail) {
+	if (LTYPE(v) == LVAL_QEXPR || LTYPE(v) == LVAL_SEXPR) { lana_sexpr(c, i, v, tail); }
+	else { lana_expr(c, i, v); }
+}
+
+// analyze the children of v as an S-Expression
+lval* lval_analyze(lval* v) {
+	struct lcompiler c = { NULL, 0, 0, NULL, 0, 0, NULL, 0, 0 };
+	lana_sexpr(&c, lana_nodes(&c, 1), v, 1);
+
+	lval* x = lval_alloc(LVAL_CODE);
+	x->ops = NULL;
+	x->nops = c.nnodes;
+	x->consts = c.consts;
+	x->nconsts = c.nconsts;
+	x->nodes = realloc(c.nodes, sizeof(lnode) * c.nnodes);
+
+	// the nodes are in place now, so children can be pointed at
+	for (int i = 0; i < x->nops; i++) { x->nodes[i].kids = x->nodes + x->nodes[i].first; }
+	return x;
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+// the analysis of the expression v, made the first time it is needed
+lval* lval_analysis(lval* v) {
+	if (v->code && !v->code->nodes) { lval_del(v->code); v->code = NULL; }
+	if (!v->code) { v->code = lval_analyze(v); }
+	return v->code;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+// execute analyzed code in e until it returns, along with the tail calls it ends in.
+// takes the reference to code, and ownership of e and fun when fun is not NULL
+lval* lnode_run(lval* code, lenv* e, lval* fun) {
+	// lets in tail position end here, along with the frame
+	int lets = llets.count;
+	lenv* frame = e;
+
+	while (1) {
+		lval* r = code->nodes->exec(code->nodes, e);
+		lval_del(code);
+		if (r != LTAIL) {
+			llet_unwind(lets);
+			if (fun) { lenv_release(frame); lval_del(fun); }
+			return r;
+		}
+
+		// lambdas continue in their new frame, eval and if in the same one
+		code = ltail.code;
+		if (ltail.fun) {
+			// with --dynamic the new frame's parent may be the one being left
+			if (lenv_dynamic) { lenv_box(ltail.env); }
+			llet_unwind(lets);
+			if (fun) { lenv_release(frame); lval_del(fun); }
+			frame = ltail.env;
+			fun = ltail.fun;
+		}
+		e = ltail.env;
+
+		// every value is either owned by the heap or held here, so it is safe to collect
+		if (heap.pending) { lgc_collect_minor(); }
+	}
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+// evaluate the S-Expression v in e by analyzing it
+lval* lnode_eval(lenv* e, lval* v) {
+	lval* code = lval_analyze(v);
+	lval_del(v);
+	return lnode_run(code, e, NULL);
 }
 
+/* Arithmetic
+ *
+ * each operator has its own kernel, generated by LARITH, which checks the
+ * operand types once and then folds the numbers straight out of the argument
+ * array. results that overflow a long are an error rather than wrapping
+ * around, checked with the compiler's overflow builtins
+ */
+#define LARITH(name, op, unary, step) \
+  lval* name(lenv* e, lval* a) { \
+    LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", op); \
+    for (int i = 0; i < a->count; i++) { LASSERT_TYPE(op, a, i, LVAL_NUM); } \
+    long r = LNUM(a->cell[0]); \
+    if (a->count == 1) { unary; } \
+    for (int i = 1; i < a->count; i++) { \
+      long n = LNUM(a->cell[i]); \
+      step; \
+    } \
+    lval_del(a); \
+    return lval_num(r); \
+  }
+
+#define LOVERFLOW(op) "Integer overflow in '" op "'."
+
+LARITH(builtin_add, "+", ,
+  LASSERT(a, !__builtin_add_overflow(r, n, &r), LOVERFLOW("+")))
+
+// with one argument, - negates it
+LARITH(builtin_sub, "-",
+  LASSERT(a, !__builtin_sub_overflow(0, r, &r), LOVERFLOW("-")),
+  LASSERT(a, !__builtin_sub_overflow(r, n, &r), LOVERFLOW("-")))
+
+LARITH(builtin_mul, "*", ,
+  LASSERT(a, !__builtin_mul_overflow(r, n, &r), LOVERFLOW("*")))
+
+LARITH(builtin_div, "/", ,
+  LASSERT(a, n != 0, "Division By Zero!");
+  LASSERT(a, !(r == LONG_MIN && n == -1), LOVERFLOW("/"));
+  r /= n)
+
 lval* builtin_head(lenv* e, lval* a) {
   LASSERT_NUM("head", a, 1);
   LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("head", a, 0);
   
-  lval* v = lval_take(a, 0);  
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+  // only the first cell survives so build a new list rather than copying the whole one
+  lval* q = lval_take(a, 0);
+  lval* v = lval_add(lval_qexpr(), lval_ref(q->cell[0]));
+  lval_del(q);
   return v;
 }
 
@@ -563,51 +2391,512 @@ lval* builtin_tail(lenv* e, lval* a) {
   LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("tail", a, 0);
 
-  lval* v = lval_take(a, 0);  
+  // a list someone else holds stays as it is, the tail is a view of its cells
+  lval* q = lval_take(a, 0);
+  if (q->refs > 1) {
+    lval* v = lval_slice(q, 1, q->count - 1);
+    lval_del(q);
+    return v;
+  }
+
+  lval* v = lval_own(q);
   lval_del(lval_pop(v, 0));
   return v;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-	a->type = LVAL_QEXPR;
-	return a;
-}
+lval* builtin_list(lenv* e, lval* a) {
+	a->type = LVAL_QEXPR;
+	return a;
+}
+
+// the Q-Expression eval was passed, to evaluate as an S-Expression
+lval* lval_eval_arg(lval* a) {
+  LASSERT_NUM("eval", a, 1);
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+  
+  return lval_take(a, 0);
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+  lval* x = lval_eval_arg(a);
+  if (LTYPE(x) == LVAL_ERR) { return x; }
+  lval* r = lval_eval_qexpr(e, x);
+  lval_del(x);
+  return r;
+}
+
+lval* lval_join(lval* x, lval* y) {
+	lval_reserve(x, x->count + y->count);
+
+	// a y nothing else holds can hand its cells over as they are. an empty one has none to copy
+	if (y->count && y->refs == 1 && !y->view) {
+		memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+		x->count += y->count;
+		y->count = 0;
+	}
+
+	// otherwise for each cell in 'y', add a reference to it to 'x'
+	for (int i = 0; i < y->count; i++) {
+		x->cell[x->count++] = lval_ref(y->cell[i]);
+	}
+
+	// release y and return x
+	lval_del(y);
+	return x;
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+	
+	for (int i = 0; i < a->count; i++) {
+		LASSERT(a, LTYPE(a->cell[i]) == LVAL_QEXPR,
+			"Function 'join' passed incorrect type.");
+	}
+
+	lval* x = lval_own(lval_pop(a, 0));
+
+	// size the result once, the pops below only step over the front of a
+	int n = x->count;
+	for (int i = 0; i < a->count; i++) { n += a->cell[i]->count; }
+	lval_reserve(x, n);
+
+	while (a->count) {
+		x = lval_join(x, lval_pop(a, 0));
+	}
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+  lval* x = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+  long i = LNUM(a->cell[0]);
+  lval* l = a->cell[1];
+  LASSERT(a, i >= 0 && i < l->count,
+    "Function 'nth' passed index %li for a list of %i items.", i, l->count);
+
+  lval* x = lval_ref(l->cell[i]);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+  LASSERT_NUM("last", a, 1);
+  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("last", a, 0);
+
+  lval* l = a->cell[0];
+  lval* x = lval_ref(l->cell[l->count - 1]);
+  lval_del(a);
+  return x;
+}
+
+// the cells of the list l from 'from' up to 'to', each clamped to the list. l
+// is shared with the result rather than copied, and the callers reference released
+lval* lval_range(lval* l, long from, long to) {
+  if (to > l->count) { to = l->count; }
+  if (from < 0) { from = 0; }
+  if (from > to) { from = to; }
+  lval* x = lval_slice(l, from, to - from);
+  lval_del(l);
+  return x;
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_SEQ("take", a, 1);
+
+  long n = LNUM(a->cell[0]);
+
+  // taken from a sequence the elements are still only made when read
+  if (LTYPE(a->cell[1]) == LVAL_SEQ) {
+    lval* s = lval_seq(LSEQ_TAKE, NULL, lval_ref(a->cell[1]), n);
+    lval_del(a);
+    return s;
+  }
+  return lval_range(lval_take(a, 1), 0, n);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  LASSERT_NUM("drop", a, 2);
+  LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+  LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+
+  long n = LNUM(a->cell[0]);
+  lval* l = lval_take(a, 1);
+  return lval_range(l, n, l->count);
+}
+
+// (slice from to l) is the cells of l from 'from' up to but not including 'to'
+lval* builtin_slice(lenv* e, lval* a) {
+  LASSERT_NUM("slice", a, 3);
+  LASSERT_TYPE("slice", a, 0, LVAL_NUM);
+  LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+  LASSERT_TYPE("slice", a, 2, LVAL_QEXPR);
+
+  long from = LNUM(a->cell[0]);
+  long to = LNUM(a->cell[1]);
+  return lval_range(lval_take(a, 2), from, to);
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+  LASSERT_NUM("reverse", a, 1);
+  LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+  // a shared list is copied once, then the cells are swapped in place
+  lval* v = lval_own(lval_take(a, 0));
+  lval_reserve(v, v->count);
+  for (int i = 0, j = v->count - 1; i < j; i++, j--) {
+    lval* x = v->cell[i];
+    v->cell[i] = v->cell[j];
+    v->cell[j] = x;
+  }
+  return v;
+}
+
+// call f with x, and y after it unless y is NULL, as if from an S-Expression
+lval* lval_apply(lenv* e, lval* f, lval* x, lval* y) {
+  // two small numbers through an arithmetic kernel need no argument list
+  if (f->builtin && y) {
+    lval* r = lval_binary(f->builtin, x, y);
+    if (r) { return r; }
+  }
+
+  // nor does a lambda taking exactly what it is given, which binds it straight into its frame
+  if (f->env && !f->rest && f->arity == (y ? 2 : 1)) {
+    lenv* frame = lenv_new();
+    frame->par = lenv_dynamic ? e : f->env;
+    lenv_put(frame, f->formals->cell[0], x);
+    if (y) { lenv_put(frame, f->formals->cell[1], y); }
+    lval* r = lval_eval_qexpr(frame, f->body);
+    lenv_release(frame);
+    return r;
+  }
+
+  lval* a = lval_sexpr();
+  lval_reserve(a, 2);
+  a->cell[a->count++] = lval_ref(x);
+  if (y) { a->cell[a->count++] = lval_ref(y); }
+  return lval_call(e, f, a);
+}
+
+// call the predicate f passed to func with x, giving 1 or 0, or -1 with the error in *err
+int lval_test(lenv* e, char* func, lval* f, lval* x, lval** err) {
+  lval* r = lval_apply(e, f, x, NULL);
+  if (LTYPE(r) == LVAL_NUM) {
+    int t = LNUM(r) != 0;
+    lval_del(r);
+    return t;
+  }
+  if (LTYPE(r) == LVAL_ERR) {
+    *err = r;
+  } else {
+    *err = lval_err("Function '%s' passed a function returning %s, Expected %s.",
+      func, ltype_name(LTYPE(r)), ltype_name(LVAL_NUM));
+    lval_del(r);
+  }
+  return -1;
+}
+
+/* Sequences
+ *
+ * a sequence holds how to make its elements rather than the elements, so a
+ * chain of them over a huge or endless range only ever has one element in
+ * flight. reading one goes through an liter, a cursor for each sequence in
+ * the chain down to the range or list at the bottom, which keeps the
+ * position so the sequences themselves stay unchanged and can be read again.
+ * lists can be read through an liter too, so the builtins that walk their
+ * argument take either */
+
+lval* lval_seq(int kind, lval* fn, lval* src, long limit) {
+  lval* v = lval_alloc(LVAL_SEQ);
+  v->kind = kind;
+  v->fn = fn;
+  v->src = src;
+  v->limit = limit;
+  return v;
+}
+
+typedef struct liter liter;
+
+struct liter {
+  lval* seq;   // sequence or list being read, held by whoever opened the cursor
+  long i;      // next index of a list or range, or elements take has let through
+  lval* cur;   // last value iterate made
+  liter* src;  // cursor over the sequence this one reads from
+};
+
+// open a cursor over the sequence or list v, close it with liter_close
+liter* liter_open(lval* v) {
+  int n = 1;
+  for (lval* s = v; LTYPE(s) == LVAL_SEQ && s->kind != LSEQ_RANGE && s->kind != LSEQ_ITERATE; s = s->src) { n++; }
+
+  liter* it = malloc(sizeof(liter) * n);
+  for (int k = 0; k < n; k++) {
+    it[k].seq = v;
+    it[k].i = LTYPE(v) == LVAL_SEQ && v->kind == LSEQ_RANGE ? v->from : 0;
+    it[k].cur = NULL;
+    it[k].src = NULL;
+    if (k + 1 < n) {
+      it[k].src = &it[k + 1];
+      v = v->src;
+    }
+  }
+  return it;
+}
+
+void liter_close(liter* it) {
+  for (liter* k = it; k; k = k->src) { if (k->cur) { lval_del(k->cur); } }
+  free(it);
+}
+
+// the next element of the cursor, calling any functions of the sequence in e.
+// NULL once there are no more, or an error if making the element failed
+lval* liter_next(liter* it, lenv* e) {
+  lval* s = it->seq;
+  if (LTYPE(s) == LVAL_QEXPR) {
+    return it->i < s->count ? lval_ref(s->cell[it->i++]) : NULL;
+  }
+
+  switch (s->kind) {
+    case LSEQ_RANGE:
+      return it->i < s->limit ? lval_num(it->i++) : NULL;
+
+    case LSEQ_MAP: {
+      lval* x = liter_next(it->src, e);
+      if (!x || LTYPE(x) == LVAL_ERR) { return x; }
+      lval* y = lval_apply(e, s->fn, x, NULL);
+      lval_del(x);
+      return y;
+    }
+
+    case LSEQ_FILTER: {
+      lval* x;
+      while ((x = liter_next(it->src, e)) && LTYPE(x) != LVAL_ERR) {
+        lval* err;
+        int t = lval_test(e, s->limit ? "filter" : "lazy-filter", s->fn, x, &err);
+        if (t == 1) { return x; }
+        lval_del(x);
+        if (t == -1) { return err; }
+      }
+      return x;
+    }
+
+    case LSEQ_TAKE:
+      if (it->i >= s->limit) { return NULL; }
+      it->i++;
+      return liter_next(it->src, e);
+
+    case LSEQ_ITERATE: {
+      lval* x = it->cur ? lval_apply(e, s->fn, it->cur, NULL) : lval_ref(s->src);
+      if (it->cur) { lval_del(it->cur); }
+      it->cur = LTYPE(x) == LVAL_ERR ? NULL : lval_ref(x);
+      return x;
+    }
+  }
+  return NULL;
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_SEQ("map", a, 1);
+
+  lval* f = a->cell[0];
+  lval* x = lval_qexpr();
+  if (LTYPE(a->cell[1]) == LVAL_QEXPR) { lval_reserve(x, a->cell[1]->count); }
+  liter* it = liter_open(a->cell[1]);
+  lval* y;
+  while ((y = liter_next(it, e))) {
+    if (LTYPE(y) != LVAL_ERR) {
+      lval* r = lval_apply(e, f, y, NULL);
+      lval_del(y);
+      y = r;
+    }
+    if (LTYPE(y) == LVAL_ERR) { lval_del(x); x = y; break; }
+    x = lval_add(x, y);
+  }
+  liter_close(it);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_SEQ("filter", a, 1);
+
+  lval* f = a->cell[0];
+  lval* x = lval_qexpr();
+  liter* it = liter_open(a->cell[1]);
+  lval* y;
+  while ((y = liter_next(it, e))) {
+    if (LTYPE(y) == LVAL_ERR) { lval_del(x); x = y; break; }
+    lval* err;
+    int t = lval_test(e, "filter", f, y, &err);
+    if (t == 1) { x = lval_add(x, y); continue; }
+    lval_del(y);
+    if (t == -1) { lval_del(x); x = err; break; }
+  }
+  liter_close(it);
+  lval_del(a);
+  return x;
+}
+
+// foldl and reduce call f with the value so far and each element in turn
+lval* lval_fold(lenv* e, lval* a, char* func) {
+  LASSERT_NUM(func, a, 3);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_SEQ(func, a, 2);
+
+  lval* f = a->cell[0];
+  lval* acc = lval_ref(a->cell[1]);
+  liter* it = liter_open(a->cell[2]);
+  lval* y;
+  while (LTYPE(acc) != LVAL_ERR && (y = liter_next(it, e))) {
+    if (LTYPE(y) == LVAL_ERR) { lval_del(acc); acc = y; break; }
+    lval* r = lval_apply(e, f, acc, y);
+    lval_del(acc);
+    lval_del(y);
+    acc = r;
+  }
+  liter_close(it);
+  lval_del(a);
+  return acc;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) { return lval_fold(e, a, "foldl"); }
+lval* builtin_reduce(lenv* e, lval* a) { return lval_fold(e, a, "reduce"); }
+
+lval* builtin_foldr(lenv* e, lval* a) {
+  LASSERT_NUM("foldr", a, 3);
+  LASSERT_TYPE("foldr", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldr", a, 2, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+  lval* acc = lval_ref(a->cell[1]);
+  for (int i = l->count - 1; i >= 0 && LTYPE(acc) != LVAL_ERR; i--) {
+    lval* y = lval_apply(e, f, l->cell[i], acc);
+    lval_del(acc);
+    acc = y;
+  }
+  lval_del(a);
+  return acc;
+}
+
+// any and all stop at the first element that decides the answer
+lval* builtin_quantify(lenv* e, lval* a, char* func, int want) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_SEQ(func, a, 1);
+
+  lval* f = a->cell[0];
+  lval* result = NULL;
+  liter* it = liter_open(a->cell[1]);
+  lval* y;
+  while (!result && (y = liter_next(it, e))) {
+    if (LTYPE(y) == LVAL_ERR) { result = y; break; }
+    lval* err;
+    int t = lval_test(e, func, f, y, &err);
+    lval_del(y);
+    if (t == -1) { result = err; }
+    else if (t == want) { result = lval_num(want); }
+  }
+  liter_close(it);
+  lval_del(a);
+  return result ? result : lval_num(!want);
+}
+
+lval* builtin_any(lenv* e, lval* a) { return builtin_quantify(e, a, "any", 1); }
+lval* builtin_all(lenv* e, lval* a) { return builtin_quantify(e, a, "all", 0); }
 
-lval* builtin_eval(lenv* e, lval* a) {
-  LASSERT_NUM("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-  
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT_NUM("range", a, 2);
+  LASSERT_TYPE("range", a, 0, LVAL_NUM);
+  LASSERT_TYPE("range", a, 1, LVAL_NUM);
+
+  lval* s = lval_seq(LSEQ_RANGE, NULL, NULL, LNUM(a->cell[1]));
+  s->from = LNUM(a->cell[0]);
+  lval_del(a);
+  return s;
 }
 
-lval* lval_join(lval* x, lval* y) {
-	// for each cell in 'y', add it to 'x'
-	while (y->count) {
-		x = lval_add(x, lval_pop(y, 0));
-	}
+// lazy-map and lazy-filter wrap f around the sequence or list they are given
+lval* lval_lazy(lenv* e, lval* a, char* func, int kind) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_SEQ(func, a, 1);
 
-	// delete the empty y and return x
-	lval_del(y);
-	return x;
+  lval* s = lval_seq(kind, lval_ref(a->cell[0]), lval_ref(a->cell[1]), 0);
+  lval_del(a);
+  return s;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-	
-	for (int i = 0; i < a->count; i++) {
-		LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-			"Function 'join' passed incorrect type.");
-	}
+lval* builtin_lazy_map(lenv* e, lval* a) { return lval_lazy(e, a, "lazy-map", LSEQ_MAP); }
+lval* builtin_lazy_filter(lenv* e, lval* a) { return lval_lazy(e, a, "lazy-filter", LSEQ_FILTER); }
 
-	lval* x = lval_pop(a, 0);
+// (iterate f x) is x, (f x), (f (f x)) and so on without end
+lval* builtin_iterate(lenv* e, lval* a) {
+  LASSERT_NUM("iterate", a, 2);
+  LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
 
-	while (a->count) {
-		x = lval_join(x, lval_pop(a, 0));
-	}
+  lval* s = lval_seq(LSEQ_ITERATE, lval_ref(a->cell[0]), lval_ref(a->cell[1]), 0);
+  lval_del(a);
+  return s;
+}
 
-	lval_del(a);
-	return x;
+/* Fusion
+ *
+ * a map or filter builds a whole list, but when the list is the sequence
+ * argument of a builtin that reads all of it in order, a lazy-map or
+ * lazy-filter gives that builtin the same elements without the list. with
+ * --fuse the analyzer and the VM make that swap, checking when the call is
+ * made that both names are still bound to the builtins, so a chain like
+ * (foldl + 0 (map f (filter p l))) runs as one loop pulling each element
+ * through liter. the functions see the same elements, but they take turns
+ * element by element instead of one finishing before the next starts. that
+ * is only invisible when they are pure: side effects interleave and of two
+ * functions that fail the one reached first gives its error, which is why
+ * it is an option. any and all are left out since they stop early, and so
+ * are the lazy builtins since they may never read to the end */
+
+// the position of the argument b reads all of in order, counting the head as 0, or 0 if none
+int lfuse_pos(lbuiltin b) {
+  if (b == builtin_map || b == builtin_filter || b == builtin_for_each) { return 2; }
+  if (b == builtin_foldl || b == builtin_reduce) { return 3; }
+  return 0;
+}
+
+// the lazy builtin that can stand in for b, or NULL
+lbuiltin lfuse_lazy(lbuiltin b) {
+  if (b == builtin_map) { return builtin_lazy_map; }
+  if (b == builtin_filter) { return builtin_lazy_filter; }
+  return NULL;
+}
+
+// call the map or filter b with a lazily. arguments it would reject go to b, so the
+// error is the one b gives
+lval* lfuse_call(lenv* e, lbuiltin b, lval* a) {
+  if (a->count != 2 || LTYPE(a->cell[0]) != LVAL_FUN
+    || (LTYPE(a->cell[1]) != LVAL_QEXPR && LTYPE(a->cell[1]) != LVAL_SEQ)) {
+    return b(e, a);
+  }
+  lval* s = lfuse_lazy(b)(e, a);
+  if (b == builtin_filter) { s->limit = 1; }
+  return s;
 }
 
 lval* builtin_var(lenv* e, lval* a, char* func) {
@@ -615,10 +2904,10 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
 	  
 	lval* syms = a->cell[0];
 	for (int i = 0; i < syms->count; i++) {
-		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+		LASSERT(a, (LTYPE(syms->cell[i]) == LVAL_SYM),
 			"Function '%s' cannot define non-symbol. "
 			"Got %s, Expected %s", func,
-			ltype_name(syms->cell[i]->type),
+			ltype_name(LTYPE(syms->cell[i])),
 			ltype_name(LVAL_SYM));
 	}
 	  
@@ -656,9 +2945,16 @@ lval* builtin_lambda(lenv* e, lval* a) {
 
   /* Check first Q-Expression contains only Symbols */
   for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+    LASSERT(a, (LTYPE(a->cell[0]->cell[i]) == LVAL_SYM),
       "Cannot define non-symbol. Got %s, Expected %s.",
-      ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+      ltype_name(LTYPE(a->cell[0]->cell[i])),ltype_name(LVAL_SYM));
+  }
+
+  /* '&' can only be followed by the single symbol the rest are bound to */
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, a->cell[0]->cell[i]->sym != lsym_rest || i == a->cell[0]->count - 2,
+      "Function format invalid. "
+      "Symbol '&' not followed by single symbol.");
   }
 
 	// pop first two arguments and pass them to lval_lambda
@@ -666,137 +2962,249 @@ lval* builtin_lambda(lenv* e, lval* a) {
 	lval* body = lval_pop(a, 0);
 	lval_del(a);
 
-	return lval_lambda(formals, body);
+	// formals are bound in the function's own frame, never the global environment
+	for (int i = 0; i < formals->count; i++) { formals->cell[i]->sym->local = 1; }
+	lval_resolve(body, formals, e);
+
+	// --analyze does the work of running the body once, here, rather than on every call
+	if (leval_mode == LEVAL_ANALYZE) { lval_analysis(body); }
+
+	return lval_lambda(e, formals, body);
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
-  
-  int r;
-  if (strcmp(op, ">")  == 0) {
-    r = (a->cell[0]->num >  a->cell[1]->num);
-  }
-  if (strcmp(op, "<")  == 0) {
-    r = (a->cell[0]->num <  a->cell[1]->num);
+// a kernel for each ordering of two numbers
+#define LORD(name, op, cmp) \
+  lval* name(lenv* e, lval* a) { \
+    LASSERT_NUM(op, a, 2); \
+    LASSERT_TYPE(op, a, 0, LVAL_NUM); \
+    LASSERT_TYPE(op, a, 1, LVAL_NUM); \
+    int r = LNUM(a->cell[0]) cmp LNUM(a->cell[1]); \
+    lval_del(a); \
+    return lval_num(r); \
   }
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
-  }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
-  }
-  lval_del(a);
-  return lval_num(r);
+
+LORD(builtin_gt, ">", >)
+LORD(builtin_lt, "<", <)
+LORD(builtin_ge, ">=", >=)
+LORD(builtin_le, "<=", <=)
+
+// pairs of values still to compare, lval_eq works through nested expressions
+// from here rather than recursively
+struct leq {
+	struct { lval* x; lval* y; }* items;
+	int count;
+	int size;
+};
+
+struct leq leq;
+
+int lval_eq(lval* x, lval* y) {
+	int eq = 1;
+
+	#define LEQ_PUSH(a, b) do { \
+		if (leq.count == leq.size) { \
+			leq.size = leq.size ? leq.size * 2 : 64; \
+			leq.items = realloc(leq.items, sizeof(*leq.items) * leq.size); \
+		} \
+		leq.items[leq.count].x = (a); leq.items[leq.count].y = (b); leq.count++; \
+	} while (0)
+
+	LEQ_PUSH(x, y);
+	while (eq && leq.count) {
+		leq.count--;
+		x = leq.items[leq.count].x;
+		y = leq.items[leq.count].y;
+
+		// different types are always unequal
+		if (LTYPE(x) != LTYPE(y)) { eq = 0; break; }
+		// compare based upon type
+		switch(LTYPE(x)) {
+			// compare nums
+			case LVAL_NUM: eq = (LNUM(x) == LNUM(y)); break;
+			// compare string values
+			case LVAL_ERR: eq = (strcmp(x->err, y->err) == 0); break;
+			case LVAL_SYM: eq = (x->sym == y->sym); break;
+			case LVAL_STR: eq = (strcmp(x->str, y->str) == 0); break;
+			// sequences may never end, so only the same one is equal
+			case LVAL_SEQ: eq = (x == y); break;
+			// if builtin compare, otherwise compare formals and body
+			case LVAL_FUN:
+				if (x->builtin || y->builtin) {
+					eq = x->builtin == y->builtin;
+				} else if (!x->env || !y->env) {
+					// partial applications are equal if they apply equal lambdas to equal arguments
+					if (x->env || y->env) { eq = 0; break; }
+					LEQ_PUSH(x->bound, y->bound);
+					LEQ_PUSH(x->fun, y->fun);
+				} else {
+					LEQ_PUSH(x->body, y->body);
+					LEQ_PUSH(x->formals, y->formals);
+				}
+			break;
+			// if list compare every individual element
+			case LVAL_QEXPR:
+			case LVAL_SEXPR:
+				if (x->count != y->count) { eq = 0; break; }
+				for (int i = x->count - 1; i >= 0; i--) { LEQ_PUSH(x->cell[i], y->cell[i]); }
+			break;
+			default: eq = 0; break;
+		}
+	}
+	#undef LEQ_PUSH
+
+	// an inequality leaves pairs behind
+	leq.count = 0;
+	return eq;
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">");
+// immediate numbers are equal exactly when their pointers are, anything else is compared by lval_eq
+#define LCMP(name, op, eq) \
+  lval* name(lenv* e, lval* a) { \
+    LASSERT_NUM(op, a, 2); \
+    lval* x = a->cell[0]; \
+    lval* y = a->cell[1]; \
+    int r = (LVAL_IMM(x) && LVAL_IMM(y)) ? x == y : lval_eq(x, y); \
+    lval_del(a); \
+    return lval_num(r == eq); \
+  }
+
+LCMP(builtin_eq, "==", 1)
+LCMP(builtin_ne, "!=", 0)
+
+// the kernel b applied to the small numbers x and y as (b x y) would be, without
+// building an argument list. NULL when b is not an arithmetic or ordering kernel,
+// either is not a small number, or the kernel would give an error, which it then
+// gives when called as usual
+lval* lval_binary(lbuiltin b, lval* x, lval* y) {
+	if (!LVAL_IMM(x) || !LVAL_IMM(y)) { return NULL; }
+	long m = LNUM(x);
+	long n = LNUM(y);
+	long r;
+	if (b == builtin_add) {
+		if (__builtin_add_overflow(m, n, &r)) { return NULL; }
+	} else if (b == builtin_sub) {
+		if (__builtin_sub_overflow(m, n, &r)) { return NULL; }
+	} else if (b == builtin_mul) {
+		if (__builtin_mul_overflow(m, n, &r)) { return NULL; }
+	} else if (b == builtin_div) {
+		if (n == 0 || (m == LONG_MIN && n == -1)) { return NULL; }
+		r = m / n;
+	} else if (b == builtin_gt) { r = m > n;
+	} else if (b == builtin_lt) { r = m < n;
+	} else if (b == builtin_ge) { r = m >= n;
+	} else if (b == builtin_le) { r = m <= n;
+	} else if (b == builtin_eq) { r = m == n;
+	} else if (b == builtin_ne) { r = m != n;
+	} else {
+		return NULL;
+	}
+	return lval_num(r);
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<");
+// the branch of if to take, to evaluate as an S-Expression
+lval* lval_if_branch(lval* a) {
+	LASSERT_NUM("if", a, 3);
+	LASSERT_TYPE("if", a, 0, LVAL_NUM);
+	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+	// if condition is true take the first expression otherwise the second
+	return lval_take(a, LNUM(a->cell[0]) ? 1 : 2);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">=");
+lval* builtin_if(lenv* e, lval* a) {
+	lval* x = lval_if_branch(a);
+	if (LTYPE(x) == LVAL_ERR) { return x; }
+	lval* r = lval_eval_qexpr(e, x);
+	lval_del(x);
+	return r;
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<=");
+/* Loops run their body in the environment they were called from, over and
+ * over, so anything the body changes with = is still there for the next
+ * iteration. dotimes and for-each bind their variable there the same way =
+ * would and update it in place, no frame is made per iteration */
+
+// evaluate the body of a loop in e, giving the error that stops the loop or NULL
+lval* lloop_body(lenv* e, lval* body) {
+	lval* r = lval_eval_qexpr(e, body);
+	if (LTYPE(r) == LVAL_ERR) { return r; }
+	lval_del(r);
+	return NULL;
 }
 
-int lval_eq(lval* x, lval* y) {
-	// different types are always unequal
-	if (x->type != y->type) { return 0; }
-	// compare based upon type
-	switch(x->type) {
-		// compare nums
-		case LVAL_NUM: return (x->num == y->num);
-		// compare string values
-		case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-		case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-		case LVAL_STR: return (strcmp(x->str, y->str) == 0);
-		// if builtin compare, otherwise compare formals and body
-		case LVAL_FUN:
-			if (x->builtin || y->builtin) {
-				return x->builtin == y->builtin;
-		      } else {
-				return lval_eq(x->formals, y->formals)
-					&& lval_eq(x->body, y->body);
-		      }
-		// if list compare every individual element
-		case LVAL_QEXPR:
-		case LVAL_SEXPR:
-			if (x->count != y->count) { return 0; }
-			for (int i = 0; i < x->count; i++) {
-				/* If any element not equal then whole list not equal */
-				if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
-			}
-			/* Otherwise lists must be equal */
-			return 1;
-		break;
-	}
-	return 0;			
+// bind the loop variable, given as {name} first in a, to x in e
+void lloop_bind(lenv* e, lval* a, lval* x) {
+	lenv_put(e, a->cell[0]->cell[0], x);
+	lval_del(x);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-	LASSERT_NUM(op, a, 2);
-	int r;
-	if (strcmp(op, "==") == 0) {
-		r =  lval_eq(a->cell[0], a->cell[1]);
-	}
-	if (strcmp(op, "!=") == 0) {
-		r = !lval_eq(a->cell[0], a->cell[1]);
+#define LASSERT_LOOP_VAR(func, args) \
+  LASSERT(args, args->cell[0]->count == 1 && LTYPE(args->cell[0]->cell[0]) == LVAL_SYM, \
+    "Function '%s' passed invalid loop variable. Expected {name}.", func)
+
+lval* builtin_while(lenv* e, lval* a) {
+	LASSERT_NUM("while", a, 2);
+	LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+
+	lval* result = NULL;
+	while (!result) {
+		lval* c = lval_eval_qexpr(e, a->cell[0]);
+		if (LTYPE(c) != LVAL_NUM) {
+			result = LTYPE(c) == LVAL_ERR ? c : lval_err(
+				"Function 'while' passed a condition returning %s, Expected %s.",
+				ltype_name(LTYPE(c)), ltype_name(LVAL_NUM));
+			if (result != c) { lval_del(c); }
+			break;
+		}
+		int go = LNUM(c) != 0;
+		lval_del(c);
+		if (!go) { break; }
+		result = lloop_body(e, a->cell[1]);
 	}
+
 	lval_del(a);
-	return lval_num(r);
+	return result ? result : lval_sexpr();
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "==");
-}
+lval* builtin_dotimes(lenv* e, lval* a) {
+	LASSERT_NUM("dotimes", a, 3);
+	LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+	LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+	LASSERT_LOOP_VAR("dotimes", a);
+
+	long n = LNUM(a->cell[1]);
+	lval* result = NULL;
+	for (long i = 0; i < n && !result; i++) {
+		lloop_bind(e, a, lval_num(i));
+		result = lloop_body(e, a->cell[2]);
+	}
 
-lval* builtin_ne(lenv* e, lval* a) {
-	return builtin_cmp(e, a, "!=");
+	lval_del(a);
+	return result ? result : lval_sexpr();
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-	LASSERT_NUM("if", a, 3);
-	LASSERT_TYPE("if", a, 0, LVAL_NUM);
-	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+lval* builtin_for_each(lenv* e, lval* a) {
+	LASSERT_NUM("for-each", a, 3);
+	LASSERT_TYPE("for-each", a, 0, LVAL_QEXPR);
+	LASSERT_SEQ("for-each", a, 1);
+	LASSERT_TYPE("for-each", a, 2, LVAL_QEXPR);
+	LASSERT_LOOP_VAR("for-each", a);
 
-	// mark both expressions as evaluable
+	lval* result = NULL;
+	liter* it = liter_open(a->cell[1]);
 	lval* x;
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
-	
-	if (a->cell[0]->num) {
-		// if condition is true evaluate first expression
-		x = lval_eval(e, lval_pop(a, 1));
-	} else {
-		// otherwise evaluate the second expression
-		x = lval_eval(e, lval_pop(a, 2));
+	while (!result && (x = liter_next(it, e))) {
+		if (LTYPE(x) == LVAL_ERR) { result = x; break; }
+		lloop_bind(e, a, x);
+		result = lloop_body(e, a->cell[2]);
 	}
-	// delete argument list and return
-	lval_del(a);
-	return x;
-}
+	liter_close(it);
 
-void lval_expr_print(lval* v, char open, char close) {
-	putchar(open);
-	for (int i = 0; i < v->count; i++) {
-		// print value contained within
-		lval_print(v->cell[i]);
-		
-		// dont print trailing space if last element
-		if (i != (v->count-1)) {
-			putchar(' ');
-		}
-	}
-	putchar(close);
+	lval_del(a);
+	return result ? result : lval_sexpr();
 }
 
 void lval_print_str(lval* v) {
@@ -811,23 +3219,75 @@ void lval_print_str(lval* v) {
 	free(escaped);
 }
 
+// what is left to print, a value or when v is NULL the string s
+struct lprint {
+	lval* v;
+	char* s;
+};
+
 void lval_print(lval* v) {
-	switch (v->type) {
-		case LVAL_NUM:   printf("%li", v->num); break;
-		case LVAL_ERR:   printf("Error: %s", v->err); break;
-    		case LVAL_SYM:   printf("%s", v->sym); break;
-    		case LVAL_STR:   lval_print_str(v); break;
-		case LVAL_FUN:	 
-			if (v->builtin) {
-				printf("<builtin>");
-			} else {
-				printf("(\\ "); lval_print(v->formals);
-				putchar(' '); lval_print(v->body); putchar(')');
-			}
-		break;
-    		case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-    		case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-  	}
+	// nested expressions are pushed here rather than printed recursively
+	struct lprint* stack = NULL;
+	int count = 0, size = 0;
+
+	#define LPRINT_PUSH(x, str) do { \
+		if (count == size) { \
+			size = size ? size * 2 : 16; \
+			stack = realloc(stack, sizeof(struct lprint) * size); \
+		} \
+		stack[count].v = (x); stack[count].s = (str); count++; \
+	} while (0)
+
+	LPRINT_PUSH(v, NULL);
+	while (count) {
+		struct lprint p = stack[--count];
+		if (!p.v) { fputs(p.s, stdout); continue; }
+		v = p.v;
+
+		switch (LTYPE(v)) {
+			case LVAL_NUM:   printf("%li", LNUM(v)); break;
+			case LVAL_ERR:   printf("Error: %s", v->err); break;
+			case LVAL_SYM:   printf("%s", v->sym->name); break;
+			case LVAL_STR:   lval_print_str(v); break;
+			case LVAL_SEQ:   printf("<sequence>"); break;
+			case LVAL_FUN:	 
+				if (v->builtin) {
+					printf("<builtin>");
+				} else if (!v->env) {
+					// a partial application prints as a lambda of the formals still unbound
+					lval* f = v->fun;
+					printf("(\\ {");
+					LPRINT_PUSH(NULL, ")");
+					LPRINT_PUSH(f->body, NULL);
+					LPRINT_PUSH(NULL, "} ");
+					for (int i = f->formals->count - 1; i >= v->bound->count; i--) {
+						LPRINT_PUSH(f->formals->cell[i], NULL);
+						if (i > v->bound->count) { LPRINT_PUSH(NULL, " "); }
+					}
+				} else {
+					// pushed in reverse, the formals come out first
+					printf("(\\ ");
+					LPRINT_PUSH(NULL, ")");
+					LPRINT_PUSH(v->body, NULL);
+					LPRINT_PUSH(NULL, " ");
+					LPRINT_PUSH(v->formals, NULL);
+				}
+			break;
+			case LVAL_SEXPR:
+			case LVAL_QEXPR:
+				putchar(v->type == LVAL_SEXPR ? '(' : '{');
+				LPRINT_PUSH(NULL, v->type == LVAL_SEXPR ? ")" : "}");
+				// dont print trailing space after the last element
+				for (int i = v->count - 1; i >= 0; i--) {
+					LPRINT_PUSH(v->cell[i], NULL);
+					if (i > 0) { LPRINT_PUSH(NULL, " "); }
+				}
+			break;
+		}
+	}
+	#undef LPRINT_PUSH
+
+	free(stack);
 }
 
 lval* builtin_print(lenv* e, lval* a) {
@@ -856,6 +3316,103 @@ lval* builtin_error(lenv* e, lval* a) {
   return err;
 }
 
+/* A lone (f) evaluates to f itself, so these take a placeholder argument, eg (gc {}) */
+#define LASSERT_PLACEHOLDER(func, args) \
+  LASSERT(args, args->count <= 1, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected 1.", \
+    func, args->count)
+
+lval* builtin_gc(lenv* e, lval* a) {
+  LASSERT_PLACEHOLDER("gc", a);
+  lval_del(a);
+
+  /* Collect now and return the number of values freed */
+  return lval_num(lgc_collect());
+}
+
+lval* builtin_clock(lenv* e, lval* a) {
+  LASSERT_PLACEHOLDER("clock", a);
+  lval_del(a);
+
+  /* Processor time used so far, in milliseconds */
+  return lval_num((long)(clock() / (CLOCKS_PER_SEC / 1000)));
+}
+
+lval* lval_stat(char* name, long x) {
+  return lval_add(lval_add(lval_qexpr(), lval_sym(name)), lval_num(x));
+}
+
+lval* builtin_gc_stats(lenv* e, lval* a) {
+  LASSERT_PLACEHOLDER("gc-stats", a);
+  lval_del(a);
+
+  /* Return {name value} pairs describing the heap */
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_stat("minor", heap.minor));
+  x = lval_add(x, lval_stat("major", heap.major));
+  x = lval_add(x, lval_stat("young", heap.young_count));
+  x = lval_add(x, lval_stat("old", heap.old_count));
+  x = lval_add(x, lval_stat("bytes", lgc_bytes(0)));
+  x = lval_add(x, lval_stat("live-bytes", lgc_bytes(1)));
+  x = lval_add(x, lval_stat("symbols", symtab.count));
+  x = lval_add(x, lval_stat("freed", heap.freed));
+  x = lval_add(x, lval_stat("allocs", heap.allocs));
+  x = lval_add(x, lval_stat("cells", lcells_allocated));
+  x = lval_add(x, lval_stat("nursery", heap.nursery));
+  x = lval_add(x, lval_stat("old-limit", heap.old_limit));
+  x = lval_add(x, lval_stat("growth", heap.growth));
+  return x;
+}
+
+lval* lval_pool_stats(struct lpool* p) {
+  long capacity = p->slab_count * p->per_slab;
+
+  /* {name item-size slabs capacity used peak free-listed fragmentation%} */
+  lval* x = lval_add(lval_qexpr(), lval_sym(p->name));
+  x = lval_add(x, lval_stat("size", p->size));
+  x = lval_add(x, lval_stat("slabs", p->slab_count));
+  x = lval_add(x, lval_stat("capacity", capacity));
+  x = lval_add(x, lval_stat("used", p->used));
+  x = lval_add(x, lval_stat("peak", p->peak));
+
+  /* Released items waiting for reuse, and how much of the carved out memory they make up */
+  long carved = capacity - (p->limit - p->bump) / (long)p->size;
+  long freed = carved - p->used;
+  x = lval_add(x, lval_stat("free", freed));
+  x = lval_add(x, lval_stat("fragmentation", carved ? freed * 100 / carved : 0));
+  return x;
+}
+
+lval* builtin_pool_stats(lenv* e, lval* a) {
+  LASSERT_PLACEHOLDER("pool-stats", a);
+  lval_del(a);
+
+  /* One entry per pool, fragmentation is the percentage of carved out items sitting on the free list */
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_pool_stats(&lval_pool));
+  x = lval_add(x, lval_pool_stats(&lenv_pool));
+  for (int i = 0; i < LCELLS_CLASSES; i++) {
+    x = lval_add(x, lval_pool_stats(&lcells_pool[i]));
+  }
+  return x;
+}
+
+lval* builtin_gc_tune(lenv* e, lval* a) {
+  LASSERT_NUM("gc-tune", a, 2);
+  LASSERT_TYPE("gc-tune", a, 0, LVAL_NUM);
+  LASSERT_TYPE("gc-tune", a, 1, LVAL_NUM);
+  LASSERT(a, LNUM(a->cell[0]) > 0 && LNUM(a->cell[1]) > 0,
+    "Function 'gc-tune' passed a nursery size or growth that is not positive.");
+
+  /* Allocations between minor collections and old generation growth percentage */
+  heap.nursery = LNUM(a->cell[0]);
+  heap.growth = LNUM(a->cell[1]);
+  if (heap.allocs >= heap.nursery) { heap.pending = 1; }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
 lval* lval_read_num(mpc_ast_t* t) {
 	errno = 0;
 	long x = strtol(t->contents, NULL, 10);
@@ -864,10 +3421,9 @@ lval* lval_read_num(mpc_ast_t* t) {
 }
 
 lval* lval_add(lval* v, lval* x) {
-	v->count++;
-  	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  	v->cell[v->count-1] = x;
-  	return v;
+	lval_reserve(v, v->count + 1);
+	v->cell[v->count++] = x;
+	return v;
 }
 
 lval* lval_read_str(mpc_ast_t* t) {
@@ -909,10 +3465,18 @@ lval* lval_read(mpc_ast_t* t) {
   	return x;
 }
 
+// copy v so it can be mutated, anything v points to is shared rather than
+// copied since shared values are never mutated
 lval* lval_copy(lval* v) {
 	
-	lval* x = malloc(sizeof(lval));
-	x->type = v->type;
+	// immediate numbers are copied by value already
+	if (LVAL_IMM(v)) { return v; }
+
+	// lists are copied as a view of the same cells, which only get copied
+	// if the copy is actually changed
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) { return lval_slice(v, 0, v->count); }
+
+	lval* x = lval_alloc(v->type);
 
 	switch (v->type) {
 		// copy functions and numbers directly
@@ -921,102 +3485,495 @@ lval* lval_copy(lval* v) {
 			if (v->builtin) {
 				x->builtin = v->builtin;
 			} else {
+				// environments are shared, not copied
 				x->builtin = NULL;
-				x->env = lenv_copy(v->env);
-				x->formals = lval_copy(v->formals);
-				x->body = lval_copy(v->body);
+				x->env = v->env;
+				if (v->env) { lval_ref(v->env->self); }
+				x->formals = lval_ref(v->formals);
+				x->body = lval_ref(v->body);
+				x->rest = v->rest;
+				x->arity = v->arity;
 			}
 		break;		
-		// copy strings using malloc and strcpy
-		case LVAL_ERR:
-			x->err = malloc(strlen(v->err) + 1);
-			strcpy(x->err, v->err); break;
-		case LVAL_SYM:
-			x->sym = malloc(strlen(v->sym) + 1);
-			strcpy(x->sym, v->sym); break;
-		case LVAL_STR: 
-			x->str = malloc(strlen(v->str) + 1);
-			strcpy(x->str, v->str); break;
-		// copy lists by copying each sub expression
-		case LVAL_SEXPR:
-		case LVAL_QEXPR:
-			x->count = v->count;
-			x->cell = malloc(sizeof(lval*) * x->count);
-			for (int i = 0; i < x->count; i++) {
-				x->cell[i] = lval_copy(v->cell[i]);
-			}
+		// symbols are interned so only the pointer is copied
+		case LVAL_SYM: x->sym = v->sym; x->depth = v->depth; x->slot = v->slot; break;
+		// sequences are never changed, so the copy shares everything
+		case LVAL_SEQ:
+			x->kind = v->kind;
+			x->fn = v->fn ? lval_ref(v->fn) : NULL;
+			if (v->kind == LSEQ_RANGE) { x->from = v->from; } else { x->src = lval_ref(v->src); }
+			x->limit = v->limit;
 		break;
+		// copy strings into the new value
+		case LVAL_ERR:
+		case LVAL_STR: x->str = lval_text(x, v->str); break;
 	}
 
 	return x;
 }
  
+// values whose last reference went while deleting another, freed by lval_del
+// from here rather than recursively so deeply nested values can be deleted
+struct ldel {
+	lval** items;
+	int count;
+	int size;
+};
+
+struct ldel ldel;
+
+// drop a reference held by a value being freed
+void ldel_drop(lval* x) {
+	if (LVAL_IMM(x) || --x->refs > 0) { return; }
+	if (ldel.count == ldel.size) {
+		ldel.size = ldel.size ? ldel.size * 2 : 256;
+		ldel.items = realloc(ldel.items, sizeof(lval*) * ldel.size);
+	}
+	ldel.items[ldel.count++] = x;
+}
+
 //for every malloc there should be a corresponding free	
 void lval_del(lval* v) {
 
+	// only the last owner frees the value, immediate numbers have nothing to free
+	if (LVAL_IMM(v) || --v->refs > 0) { return; }
+
+	int base = ldel.count;
+	while (1) {
+		switch (v->type) {
+			case LVAL_NUM: break;
+			case LVAL_SYM: break;
+			case LVAL_ERR:
+			case LVAL_STR: lval_text_free(v); break;
+			case LVAL_FUN: 
+				// a partial application's fun and bound share the slots of formals and body
+				if (!v->builtin) {
+					if (v->env) { ldel_drop(v->env->self); }
+					ldel_drop(v->formals);
+					ldel_drop(v->body);
+				}
+			break;
+			case LVAL_ENV:
+				// the environment holds its parent's box, see lenv_box
+				if (v->scope->par) { ldel_drop(v->scope->par->self); }
+				for (int i = 0; i < v->scope->count; i++) { ldel_drop(v->scope->vals[i]); }
+				v->scope->count = 0;
+				lenv_del(v->scope);
+			break;
+			/* If Qexpr or Sexpr then delete all elements inside */
+			case LVAL_QEXPR:
+			case LVAL_SEXPR:
+				if (v->view) {
+					/* A view only holds its owner, which holds the elements */
+					ldel_drop(v->owner);
+				} else {
+					for (int i = 0; i < v->count; i++) { ldel_drop(v->cell[i]); }
+					/* Also free the memory allocated to contain the pointers */
+					lcells_free(v->cell - v->head, v->size);
+				}
+				if (v->code) { ldel_drop(v->code); }
+			break;
+			case LVAL_CODE:
+				for (int i = 0; i < v->nconsts; i++) { ldel_drop(v->consts[i]); }
+				free(v->consts);
+				free(v->ops);
+				free(v->nodes);
+			break;
+			case LVAL_SEQ:
+				if (v->fn) { ldel_drop(v->fn); }
+				if (v->kind != LSEQ_RANGE) { ldel_drop(v->src); }
+			break;
+		}
+		lval_free(v);
+
+		if (ldel.count == base) { return; }
+		v = ldel.items[--ldel.count];
+	}
+}
+
+// call visit on every heap lval that v holds a reference to
+void lval_visit(lval* v, void (*visit)(lval*, void*), void* data) {
+	switch (v->type) {
+		case LVAL_FUN:
+			if (!v->builtin) {
+				visit(v->formals, data);
+				visit(v->body, data);
+				if (v->env) { visit(v->env->self, data); }
+			}
+		break;
+		case LVAL_ENV:
+			if (v->scope->par) { visit(v->scope->par->self, data); }
+			for (int i = 0; i < v->scope->count; i++) {
+				if (!LVAL_IMM(v->scope->vals[i])) { visit(v->scope->vals[i], data); }
+			}
+		break;
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			// a view holds the owner of its cells rather than the cells themselves
+			if (v->view) {
+				visit(v->owner, data);
+			} else {
+				// cells are NULL while the evaluator has taken them out
+				for (int i = 0; i < v->count; i++) {
+					if (v->cell[i] && !LVAL_IMM(v->cell[i])) { visit(v->cell[i], data); }
+				}
+			}
+			if (v->code) { visit(v->code, data); }
+		break;
+		case LVAL_CODE:
+			for (int i = 0; i < v->nconsts; i++) {
+				if (!LVAL_IMM(v->consts[i])) { visit(v->consts[i], data); }
+			}
+		break;
+		case LVAL_SEQ:
+			if (v->fn) { visit(v->fn, data); }
+			if (v->kind != LSEQ_RANGE && !LVAL_IMM(v->src)) { visit(v->src, data); }
+		break;
+	}
+}
+
+// drop every reference v holds, leaving it an empty S-Expression
+void lval_clear(lval* v) {
 	switch (v->type) {
 		case LVAL_NUM: break;
-    		case LVAL_ERR: free(v->err); break;
-    		case LVAL_SYM: free(v->sym); break;
-    		case LVAL_STR: free(v->str); break;
-		case LVAL_FUN: 
+		case LVAL_SYM: break;
+		case LVAL_ERR:
+		case LVAL_STR: lval_text_free(v); break;
+		case LVAL_FUN:
 			if (!v->builtin) {
-				lenv_del(v->env);
+				if (v->env) { lval_del(v->env->self); }
 				lval_del(v->formals);
 				lval_del(v->body);
 			}
 		break;
-    		/* If Qexpr or Sexpr then delete all elements inside */
-    		case LVAL_QEXPR:
-    		case LVAL_SEXPR:
-			for (int i = 0; i < v->count; i++) {
-        		lval_del(v->cell[i]);
-      			}
-      			/* Also free the memory allocated to contain the pointers */
-      			free(v->cell);
-    		break;
-  	}
+		case LVAL_ENV:
+			// other garbage may still reach the lenv through its functions, so it
+			// is emptied but kept until the box itself is deleted
+			if (v->scope->par) { lval_del(v->scope->par->self); }
+			v->scope->par = NULL;
+			for (int i = 0; i < v->scope->count; i++) { lval_del(v->scope->vals[i]); }
+			v->scope->count = 0;
+		return;
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			if (v->view) {
+				lval_del(v->owner);
+			} else {
+				for (int i = 0; i < v->count; i++) { lval_del(v->cell[i]); }
+				lcells_free(v->cell - v->head, v->size);
+			}
+			if (v->code) { lval_del(v->code); }
+		break;
+		case LVAL_CODE:
+			for (int i = 0; i < v->nconsts; i++) { lval_del(v->consts[i]); }
+			free(v->consts);
+			free(v->ops);
+			free(v->nodes);
+		break;
+		case LVAL_SEQ:
+			if (v->fn) { lval_del(v->fn); }
+			if (v->kind != LSEQ_RANGE) { lval_del(v->src); }
+		break;
+	}
+	v->type = LVAL_SEXPR;
+	v->view = 0;
+	v->count = 0;
+	v->size = 0;
+	v->head = 0;
+	v->cell = NULL;
+	v->code = NULL;
+}
+
+// worklist of values still to be scanned while marking
+struct lgc_stack {
+	int count;
+	int size;
+	lval** items;
+	int gen; // oldest generation being collected
+};
 
-  	free(v);
+void lgc_unref(lval* v, void* data) {
+	struct lgc_stack* s = data;
+	if (v->gc_gen <= s->gen) { v->gc_refs--; }
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-	// iterate over all items in environment
-	for (int i = 0; i < e->count; i++) {
-		// if stored string matches the symbol string return a copy of the value
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			return lval_copy(e->vals[i]);
+void lgc_push(struct lgc_stack* s, lval* v) {
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 256;
+		s->items = realloc(s->items, sizeof(lval*) * s->size);
+	}
+	s->items[s->count++] = v;
+}
+
+void lgc_mark(lval* v, void* data) {
+	struct lgc_stack* s = data;
+	if (v->gc_gen > s->gen || v->gc_refs == -1) { return; }
+	v->gc_refs = -1;
+	lgc_push(s, v);
+}
+
+// collect every value in the list, returns the number of values freed
+long lgc_collect_list(lval* list, int gen) {
+
+	// start from the reference counts and take away references held by values being collected
+	struct lgc_stack s = { 0, 0, NULL, gen };
+	for (lval* v = list->gc_next; v != list; v = v->gc_next) { v->gc_refs = v->refs; }
+	for (lval* v = list->gc_next; v != list; v = v->gc_next) { lval_visit(v, lgc_unref, &s); }
+
+	// values with references left over are roots, mark everything they reach
+	for (lval* v = list->gc_next; v != list; v = v->gc_next) {
+		if (v->gc_refs > 0) { lgc_mark(v, &s); }
+	}
+	while (s.count) { lval_visit(s.items[--s.count], lgc_mark, &s); }
+
+	// anything unmarked is garbage, hold it while breaking its references
+	for (lval* v = list->gc_next; v != list; v = v->gc_next) {
+		if (v->gc_refs != -1) { lgc_push(&s, v); }
+	}
+	long n = s.count;
+	for (int i = 0; i < s.count; i++) { s.items[i]->refs++; }
+	for (int i = 0; i < s.count; i++) { lval_clear(s.items[i]); }
+	for (int i = 0; i < s.count; i++) { lval_del(s.items[i]); }
+	free(s.items);
+
+	heap.freed += n;
+	return n;
+}
+
+// move every young value into the old generation
+void lgc_promote(void) {
+	if (heap.young.gc_next == &heap.young) { return; }
+	for (lval* v = heap.young.gc_next; v != &heap.young; v = v->gc_next) { v->gc_gen = LGEN_OLD; }
+
+	// splice the young list onto the front of the old list
+	heap.young.gc_prev->gc_next = heap.old.gc_next;
+	heap.old.gc_next->gc_prev = heap.young.gc_prev;
+	heap.old.gc_next = heap.young.gc_next;
+	heap.young.gc_next->gc_prev = &heap.old;
+	heap.young.gc_prev = heap.young.gc_next = &heap.young;
+
+	heap.old_count += heap.young_count;
+	heap.young_count = 0;
+}
+
+// collect the whole heap, returns the number of values freed
+long lgc_collect(void) {
+	lgc_promote();
+	long n = lgc_collect_list(&heap.old, LGEN_OLD);
+
+	// let the old generation grow in proportion to what survived before the next full collection
+	heap.old_limit = heap.old_count + heap.old_count * heap.growth / 100;
+	if (heap.old_limit < heap.nursery) { heap.old_limit = heap.nursery; }
+	heap.major++;
+	return n;
+}
+
+// collect the young generation and promote the survivors, collecting everything if the old generation is full
+long lgc_collect_minor(void) {
+	long n = lgc_collect_list(&heap.young, LGEN_YOUNG);
+	lgc_promote();
+	heap.minor++;
+	if (heap.old_count > heap.old_limit) { n += lgc_collect(); }
+	heap.allocs = 0;
+	heap.pending = 0;
+	return n;
+}
+
+// approximate number of bytes held by the heap, or only those in use by live values
+long lgc_bytes(int live) {
+	// everything held by the pools
+	long bytes = lpool_bytes(&lval_pool, live) + lpool_bytes(&lenv_pool, live);
+	for (int i = 0; i < LCELLS_CLASSES; i++) { bytes += lpool_bytes(&lcells_pool[i], live); }
+
+	// plus what values hold outside the pools
+	lval* lists[2] = { &heap.young, &heap.old };
+	for (int l = 0; l < 2; l++)
+	for (lval* v = lists[l]->gc_next; v != lists[l]; v = v->gc_next) {
+		switch (v->type) {
+			case LVAL_ERR:
+			case LVAL_STR:
+				if (v->str != v->text) { bytes += strlen(v->str) + 1; }
+			break;
+			case LVAL_ENV:
+				if (v->scope->syms != v->scope->inline_syms) {
+					bytes += v->scope->size * (sizeof(lsym*) + sizeof(lval*));
+				}
+				bytes += v->scope->index_size * sizeof(int);
+			break;
+			case LVAL_QEXPR:
+			case LVAL_SEXPR:
+				if (lcells_class(v->size) == -1) { bytes += v->size * sizeof(lval*); }
+			break;
+			case LVAL_CODE:
+				bytes += v->nops * (v->nodes ? sizeof(lnode) : sizeof(int)) + v->nconsts * sizeof(lval*);
+			break;
 		}
 	}
-	// if no symbol found check parent otherwise error
-	if (e->par) {
-		return lenv_get(e->par, k);	
+	return bytes;
+}
+
+// slot holding the binding for s in e alone, or -1
+int lenv_find(lenv* e, lsym* s) {
+	if (!e->index) {
+		for (int i = 0; i < e->count; i++) {
+			if (e->syms[i] == s) { return i; }
+		}
+		return -1;
+	}
+	int mask = e->index_size - 1;
+	for (int i = s->hash & mask; e->index[i]; i = (i + 1) & mask) {
+		if (e->syms[e->index[i] - 1] == s) { return e->index[i] - 1; }
+	}
+	return -1;
+}
+
+// rebuild the index at twice the number of slots, so it is never more than half full
+void lenv_reindex(lenv* e) {
+	free(e->index);
+	e->index_size = e->size * 2;
+	e->index = calloc(e->index_size, sizeof(int));
+	int mask = e->index_size - 1;
+	for (int j = 0; j < e->count; j++) {
+		int i = e->syms[j]->hash & mask;
+		while (e->index[i]) { i = (i + 1) & mask; }
+		e->index[i] = j + 1;
+	}
+}
+
+// make room for at least n bindings, growing geometrically
+void lenv_reserve(lenv* e, int n) {
+	if (n <= e->size) { return; }
+	int size = e->size;
+	while (size < n) { size *= 2; }
+	if (e->syms == e->inline_syms) {
+		e->syms = malloc(sizeof(lsym*) * size);
+		e->vals = malloc(sizeof(lval*) * size);
+		memcpy(e->syms, e->inline_syms, sizeof(lsym*) * e->count);
+		memcpy(e->vals, e->inline_vals, sizeof(lval*) * e->count);
 	} else {
-		return lval_err("unbound symbol!", k->sym);
+		e->syms = realloc(e->syms, sizeof(lsym*) * size);
+		e->vals = realloc(e->vals, sizeof(lval*) * size);
 	}
+	e->size = size;
+	if (e->index) { lenv_reindex(e); }
 }
 
+lval* lenv_get(lenv* e, lval* k) {
+	lsym* s = k->sym;
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-	// iterate over all items in environment to see if the varaible exists already
-	for (int i = 0; i < e->count; i++) {
-		// if variable is found delete item at that position
-		// and replace it with variable supplied by user
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
-			return;
+	// a symbol that was never bound locally can only be in its global slot
+	if (!s->local) {
+		if (s->genv) { return lval_ref(s->genv->vals[s->gslot]); }
+		return lval_err("unbound symbol!", s->name);
+	}
+
+	// try the frame and slot this reference resolved to, as long as no nearer frame
+	// has since bound the same symbol
+	if (k->depth >= 0) {
+		lenv* f = e;
+		int d = 0;
+		while (d < k->depth && f && lenv_find(f, s) == -1) { f = f->par; d++; }
+		if (d == k->depth && f && k->slot < f->count && f->syms[k->slot] == s) {
+			return lval_ref(f->vals[k->slot]);
+		}
+	}
+
+	// look in each environment up the chain of parents
+	for (int d = 0; e; e = e->par, d++) {
+		int i = lenv_find(e, s);
+		// if a binding matches remember where and return a reference to the value
+		if (i != -1) {
+			k->depth = d;
+			k->slot = i;
+			return lval_ref(e->vals[i]);
+		}
+	}
+	// if no symbol found in any of them error
+	return lval_err("unbound symbol!", s->name);
+}
+
+// resolve the symbol v, see lval_resolve
+void lval_resolve_sym(lval* v, lval* formals, lenv* e) {
+	for (int i = 0, slot = 0; i < formals->count; i++) {
+		lsym* s = formals->cell[i]->sym;
+		if (s == lsym_rest) { continue; }
+		if (s == v->sym) { v->depth = 0; v->slot = slot; return; }
+		slot++;
+	}
+	// globals are looked up through the symbol itself
+	for (int d = 1; e->par; e = e->par, d++) {
+		int i = lenv_find(e, v->sym);
+		if (i != -1) { v->depth = d; v->slot = i; return; }
+	}
+}
+
+// resolve references in the body of a lambda created in e to the frame and slot
+// they will be found at. formals are bound in order so the nth symbol (skipping &)
+// is always in slot n of the call's frame, and e's frames are its parents
+void lval_resolve(lval* v, lval* formals, lenv* e) {
+	// nested expressions are pushed here rather than resolved recursively
+	lval** stack = NULL;
+	int count = 0, size = 0;
+
+	#define LRESOLVE_PUSH(x) do { \
+		if (count == size) { \
+			size = size ? size * 2 : 16; \
+			stack = realloc(stack, sizeof(lval*) * size); \
+		} \
+		stack[count++] = (x); \
+	} while (0)
+
+	LRESOLVE_PUSH(v);
+	while (count) {
+		v = stack[--count];
+		if (LVAL_IMM(v)) { continue; }
+		if (v->type == LVAL_SYM) {
+			lval_resolve_sym(v, formals, e);
+		} else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+			for (int i = v->count - 1; i >= 0; i--) { LRESOLVE_PUSH(v->cell[i]); }
 		}
 	}
+	#undef LRESOLVE_PUSH
+
+	free(stack);
+}
+
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+	// if variable is found replace the value at that slot
+	// with the variable supplied by user
+	int i = lenv_find(e, k->sym);
+	if (i != -1) {
+		lval_ref(v);
+		lval_del(e->vals[i]);
+		e->vals[i] = v;
+		return;
+	}
+
+	// a binding in a function's environment means the symbol can no longer be
+	// looked up in its global slot directly, otherwise this is the global slot
+	if (e->par) {
+		k->sym->local = 1;
+	} else if (!k->sym->local) {
+		k->sym->genv = e;
+		k->sym->gslot = e->count;
+	}
 
-	// if no existing entry found allocate space for a new entry
+	// if no existing entry found add a new slot on the end
+	lenv_reserve(e, e->count + 1);
+	e->vals[e->count] = lval_ref(v);
+	e->syms[e->count] = k->sym;
 	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-	e->syms = realloc(e->syms, sizeof(char*) * e->count);
-	// copy contents of lval and symbol string into new location
-	e->vals[e->count-1] = lval_copy(v);
-	e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-	strcpy(e->syms[e->count-1], k->sym);
+
+	// index the new slot, or start indexing once linear search gets long
+	if (e->index) {
+		int mask = e->index_size - 1;
+		int j = k->sym->hash & mask;
+		while (e->index[j]) { j = (j + 1) & mask; }
+		e->index[j] = e->count;
+	} else if (e->count > LENV_LINEAR) {
+		lenv_reindex(e);
+	}
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
@@ -1027,16 +3984,15 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 }
 
 lenv* lenv_copy(lenv* e) {
-	lenv* n = malloc(sizeof(lenv));
+	lenv* n = lenv_new();
 	n->par = e->par;
+	lenv_reserve(n, e->count);
 	n->count = e->count;
-	n->syms = malloc(sizeof(char*) * n->count);
-	n->vals = malloc(sizeof(lval*) * n->count);
 	for (int i = 0; i < e->count; i++) {
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(n->syms[i], e->syms[i]);
-		n->vals[i] = lval_copy(e->vals[i]);
+		n->syms[i] = e->syms[i];
+		n->vals[i] = lval_ref(e->vals[i]);
 	}
+	if (e->index) { lenv_reindex(n); }
 	return n;
 }
 
@@ -1063,7 +4019,7 @@ lval* builtin_load(lenv* e, lval* a) {
     while (expr->count) {
       lval* x = lval_eval(e, lval_pop(expr, 0));
       /* If Evaluation leads to error print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      if (LTYPE(x) == LVAL_ERR) { lval_println(x); }
       lval_del(x);
     }
 
@@ -1108,6 +4064,26 @@ void lenv_add_builtins(lenv* e) {
   	lenv_add_builtin(e, "tail", builtin_tail);
   	lenv_add_builtin(e, "eval", builtin_eval);
   	lenv_add_builtin(e, "join", builtin_join);
+  	lenv_add_builtin(e, "len", builtin_len);
+  	lenv_add_builtin(e, "nth", builtin_nth);
+  	lenv_add_builtin(e, "last", builtin_last);
+  	lenv_add_builtin(e, "take", builtin_take);
+  	lenv_add_builtin(e, "drop", builtin_drop);
+  	lenv_add_builtin(e, "slice", builtin_slice);
+  	lenv_add_builtin(e, "reverse", builtin_reverse);
+  	lenv_add_builtin(e, "map", builtin_map);
+  	lenv_add_builtin(e, "filter", builtin_filter);
+  	lenv_add_builtin(e, "foldl", builtin_foldl);
+  	lenv_add_builtin(e, "foldr", builtin_foldr);
+  	lenv_add_builtin(e, "any", builtin_any);
+  	lenv_add_builtin(e, "all", builtin_all);
+
+  	/* Sequence Functions */
+  	lenv_add_builtin(e, "range", builtin_range);
+  	lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+  	lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+  	lenv_add_builtin(e, "iterate", builtin_iterate);
+  	lenv_add_builtin(e, "reduce", builtin_reduce);
   
   	/* Mathematical Functions */
   	lenv_add_builtin(e, "+", builtin_add);
@@ -1115,8 +4091,18 @@ void lenv_add_builtins(lenv* e) {
   	lenv_add_builtin(e, "*", builtin_mul);
   	lenv_add_builtin(e, "/", builtin_div);
   	
+  	/* Memory Functions */
+  	lenv_add_builtin(e, "gc", builtin_gc);
+  	lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+  	lenv_add_builtin(e, "gc-tune", builtin_gc_tune);
+  	lenv_add_builtin(e, "pool-stats", builtin_pool_stats);
+  	lenv_add_builtin(e, "clock", builtin_clock);
+
   	/* Comparison Functions */
 	lenv_add_builtin(e, "if", builtin_if);
+	lenv_add_builtin(e, "while", builtin_while);
+	lenv_add_builtin(e, "dotimes", builtin_dotimes);
+	lenv_add_builtin(e, "for-each", builtin_for_each);
 	lenv_add_builtin(e, "==", builtin_eq);
 	lenv_add_builtin(e, "!=", builtin_ne);
 	lenv_add_builtin(e, ">",  builtin_gt);